@@ -0,0 +1,275 @@
+#ifndef BENCHMARK_H_INCLUDED
+#define BENCHMARK_H_INCLUDED
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+/// Seeded workload generator and timing harness for the benchmark drivers. Every driver runs
+/// the same operation streams through its container and through a naive baseline that keeps
+/// only the log of operations and replays it for every query, then reports throughput, the
+/// latency of sampled operations and whether the results of both agree.
+///
+/// Options of the drivers:
+///     --ops N[,N...]         sizes of the workloads (default 10000,100000,1000000)
+///     --mix NAME[,NAME...]   append_only, past_insert, delete_heavy, query_heavy or all
+///     --seed S               seed of the generator (default 1)
+///     --keys K               values are drawn from [0, K) (default 1000)
+///     --baseline-limit N     the baseline is run only on workloads of at most N operations,
+///                            since it takes O(n) per operation (default 20000)
+
+enum class workload_mix { append_only, past_insert, delete_heavy, query_heavy };
+
+inline const char *workload_mix_name(workload_mix mix) {
+    static const char *names[] = {"append_only", "past_insert", "delete_heavy", "query_heavy"};
+    return names[static_cast<int>(mix)];
+}
+
+/// One operation of a workload. The drivers map it onto their containers:
+///     update: insert / push (if add is set) or erase / pop at time tm, side picks back or front
+///     remove: delete_operation(tm) of an operation generated earlier
+///     query:  find / back / front ... at time tm, where tm == LLONG_MAX means the present
+struct workload_op {
+    enum kind_t : unsigned char { update, remove, query };
+
+    kind_t kind;
+    bool add;
+    bool side;
+    int value;
+    long long tm;
+};
+
+class workload_generator {
+    static const long long time_step = 16; // leaves room for updates in the past
+
+    std::mt19937_64 rng;
+    int present_share, past_share, remove_share; // percentages, the rest are queries
+    int keys;
+    long long now;
+    std::vector<long long> update_times; // candidates for remove operations
+
+    inline long long past_time() {
+        return now == 0 ? 0 : static_cast<long long>(rng() % static_cast<unsigned long long>(now));
+    }
+
+public:
+    workload_generator(workload_mix mix, uint64_t seed, int keys) : rng(seed), keys(keys), now(0) {
+        static const int shares[][3] = { // present updates, past updates, removes
+            {90, 0, 0},   // append_only
+            {40, 40, 0},  // past_insert
+            {30, 20, 30}, // delete_heavy
+            {5, 5, 0}     // query_heavy
+        };
+        const int *share = shares[static_cast<int>(mix)];
+        present_share = share[0];
+        past_share = share[1];
+        remove_share = share[2];
+    }
+
+    workload_op next() {
+        workload_op op;
+        int dice = static_cast<int>(rng() % 100);
+        op.add = (rng() % 5 < 3); // 60% of updates are insertions, so the containers grow
+        op.side = (rng() & 1);
+        op.value = static_cast<int>(rng() % static_cast<unsigned>(keys));
+
+        if (dice < present_share + past_share) {
+            op.kind = workload_op::update;
+            if (dice < present_share) {
+                op.tm = now;
+                now += time_step;
+            } else
+                op.tm = past_time();
+            update_times.push_back(op.tm);
+        } else if (dice < present_share + past_share + remove_share && !update_times.empty()) {
+            op.kind = workload_op::remove;
+            size_t i = rng() % update_times.size();
+            op.tm = update_times[i];
+            update_times[i] = update_times.back();
+            update_times.pop_back();
+        } else {
+            op.kind = workload_op::query;
+            bool present = (remove_share == 0 && past_share == 0) || (rng() & 1);
+            op.tm = present ? std::numeric_limits<long long>::max() : past_time();
+        }
+        return op;
+    }
+};
+
+
+struct benchmark_options {
+    std::vector<long long> sizes;
+    std::vector<workload_mix> mixes;
+    uint64_t seed;
+    int keys;
+    long long baseline_limit;
+
+    benchmark_options() : sizes{10000, 100000, 1000000},
+            mixes{workload_mix::append_only, workload_mix::past_insert, workload_mix::delete_heavy,
+                  workload_mix::query_heavy},
+            seed(1), keys(1000), baseline_limit(20000) { }
+};
+
+inline std::vector<std::string> split_list(const char *list) {
+    std::vector<std::string> items;
+    std::string item;
+    for (const char *c = list; ; ++c) {
+        if (*c == ',' || *c == '\0') {
+            if (!item.empty())
+                items.push_back(item);
+            item.clear();
+            if (*c == '\0')
+                break;
+        } else
+            item.push_back(*c);
+    }
+    return items;
+}
+
+/// Returns false and prints the usage on unknown options.
+inline bool parse_benchmark_options(int argc, char *argv[], benchmark_options& options) {
+    for (int i = 1; i < argc; ++i) {
+        const char *value = (i + 1 < argc ? argv[i + 1] : nullptr);
+        if (!value)
+            return false;
+
+        if (std::strcmp(argv[i], "--ops") == 0) {
+            options.sizes.clear();
+            for (const std::string& size : split_list(value))
+                options.sizes.push_back(std::atoll(size.c_str()));
+        } else if (std::strcmp(argv[i], "--mix") == 0) {
+            options.mixes.clear();
+            for (const std::string& name : split_list(value)) {
+                bool known = false;
+                for (int m = 0; m < 4; ++m)
+                    if (name == "all" || name == workload_mix_name(static_cast<workload_mix>(m))) {
+                        options.mixes.push_back(static_cast<workload_mix>(m));
+                        known = true;
+                    }
+                if (!known)
+                    return false;
+            }
+        } else if (std::strcmp(argv[i], "--seed") == 0) {
+            options.seed = std::strtoull(value, nullptr, 10);
+        } else if (std::strcmp(argv[i], "--keys") == 0) {
+            options.keys = std::max(1, std::atoi(value));
+        } else if (std::strcmp(argv[i], "--baseline-limit") == 0) {
+            options.baseline_limit = std::atoll(value);
+        } else
+            return false;
+        ++i;
+    }
+    return true;
+}
+
+
+struct benchmark_result {
+    double seconds;
+    uint64_t checksum; // of the results of all the operations, to compare with the baseline
+    long long p50_ns, p99_ns, max_ns; // latency of the sampled operations
+};
+
+/// Runs n operations of the workload through adapter.apply(op), which returns the result of
+/// the operation as a number (whether an update succeeded, the answer of a query...). The
+/// operations are generated in chunks outside of the timed region, and one operation of
+/// every n / 100000 is timed on its own for the latency percentiles.
+template<typename Adapter>
+benchmark_result run_workload(Adapter& adapter, workload_mix mix, long long n, const benchmark_options& options) {
+    typedef std::chrono::steady_clock clock;
+    const size_t chunk_size = 4096;
+
+    workload_generator generator(mix, options.seed, options.keys);
+    std::vector<workload_op> chunk;
+    chunk.reserve(chunk_size);
+    long long stride = std::max(1LL, n / 100000);
+    std::vector<long long> latencies;
+
+    benchmark_result result;
+    result.checksum = 14695981039346656037ULL;
+    clock::duration total(0);
+    for (long long done = 0; done < n; ) {
+        chunk.clear();
+        while (chunk.size() < chunk_size && done + static_cast<long long>(chunk.size()) < n)
+            chunk.push_back(generator.next());
+
+        clock::time_point start = clock::now();
+        for (size_t i = 0; i < chunk.size(); ++i, ++done) {
+            long long answer;
+            if (done % stride == 0) {
+                clock::time_point op_start = clock::now();
+                answer = adapter.apply(chunk[i]);
+                latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - op_start).count());
+            } else
+                answer = adapter.apply(chunk[i]);
+            result.checksum = (result.checksum ^ static_cast<uint64_t>(answer)) * 1099511628211ULL;
+        }
+        total += clock::now() - start;
+    }
+
+    result.seconds = std::chrono::duration<double>(total).count();
+    std::sort(latencies.begin(), latencies.end());
+    result.p50_ns = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+    result.p99_ns = latencies.empty() ? 0 : latencies[latencies.size() * 99 / 100];
+    result.max_ns = latencies.empty() ? 0 : latencies.back();
+    return result;
+}
+
+inline void print_benchmark_header() {
+    std::cout << std::left << std::setw(14) << "mix" << std::setw(12) << "ops" << std::setw(16) << "subject"
+              << std::right << std::setw(14) << "ops/s" << std::setw(10) << "p50 ns" << std::setw(10) << "p99 ns"
+              << std::setw(12) << "max ns" << "  result" << std::endl;
+}
+
+inline void print_benchmark_row(workload_mix mix, long long n, const char *subject, const benchmark_result& result,
+                                const char *verdict) {
+    double throughput = result.seconds > 0 ? n / result.seconds : 0;
+    std::cout << std::left << std::setw(14) << workload_mix_name(mix) << std::setw(12) << n << std::setw(16) << subject
+              << std::right << std::setw(14) << static_cast<long long>(throughput) << std::setw(10) << result.p50_ns
+              << std::setw(10) << result.p99_ns << std::setw(12) << result.max_ns << "  " << verdict << std::endl;
+}
+
+/// Runs every workload of the options through the baseline (if it isn't too large) and then
+/// through each of the subjects, which are constructed from scratch for every run. Returns
+/// the process exit code: nonzero if some subject disagreed with the baseline.
+template<typename Baseline, typename... Subjects>
+struct benchmark_suite {
+    template<typename Adapter>
+    static bool run_subject(const char *name, workload_mix mix, long long n, const benchmark_options& options,
+                            bool checked, uint64_t expected) {
+        Adapter adapter;
+        benchmark_result result = run_workload(adapter, mix, n, options);
+        bool agrees = (!checked || result.checksum == expected);
+        print_benchmark_row(mix, n, name, result, !checked ? "-" : agrees ? "match" : "MISMATCH");
+        return agrees;
+    }
+
+    static int run(const benchmark_options& options) {
+        print_benchmark_header();
+        bool ok = true;
+        for (workload_mix mix : options.mixes)
+            for (long long n : options.sizes) {
+                bool checked = (n <= options.baseline_limit);
+                uint64_t expected = 0;
+                if (checked) {
+                    Baseline baseline;
+                    benchmark_result result = run_workload(baseline, mix, n, options);
+                    expected = result.checksum;
+                    print_benchmark_row(mix, n, Baseline::name(), result, "baseline");
+                }
+                bool results[] = {run_subject<Subjects>(Subjects::name(), mix, n, options, checked, expected)...};
+                for (bool agrees : results)
+                    ok = ok && agrees;
+            }
+        return ok ? 0 : 1;
+    }
+};
+
+#endif // BENCHMARK_H_INCLUDED
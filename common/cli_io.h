@@ -0,0 +1,223 @@
+#ifndef CLI_IO_H_INCLUDED
+#define CLI_IO_H_INCLUDED
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/// Input sources of the command line drivers. Each of them reads an operation name with
+/// read_operation(), its arguments with operator>>, and opens nested() readers of the same
+/// kind for the files of the "run" command.
+
+enum class cli_mode { interactive, batch, binary };
+
+inline cli_mode parse_cli_mode(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--batch") == 0)
+            return cli_mode::batch;
+        if (std::strcmp(argv[i], "--binary") == 0)
+            return cli_mode::binary;
+    }
+    return cli_mode::interactive;
+}
+
+/// Batch modes don't flush the output before reading each command.
+inline void setup_batch_output() {
+    static char buffer[1 << 20];
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
+    std::cout.rdbuf()->pubsetbuf(buffer, sizeof(buffer));
+}
+
+
+/// Plain iostream extraction, needed when commands are typed in one by one.
+class stream_reader {
+    std::istream& in;
+
+public:
+    explicit stream_reader(std::istream& in) : in(in) { }
+
+    stream_reader nested(std::istream& file) const {
+        return stream_reader(file);
+    }
+
+    bool read_operation(std::string& operation) {
+        return static_cast<bool>(in >> operation);
+    }
+
+    template<typename V>
+    stream_reader& operator>>(V& value) {
+        in >> value;
+        return *this;
+    }
+
+    explicit operator bool() const {
+        return static_cast<bool>(in);
+    }
+};
+
+
+/// Whitespace-separated text read in large chunks and parsed by hand.
+class text_reader {
+    static const size_t chunk_size = 1 << 16;
+
+    std::istream *in;
+    std::vector<char> buffer;
+    size_t pos, len;
+    bool ok;
+
+    inline int peek() {
+        if (pos == len) {
+            std::streamsize got = in->rdbuf()->sgetn(buffer.data(), buffer.size());
+            pos = 0;
+            len = got > 0 ? static_cast<size_t>(got) : 0;
+            if (len == 0)
+                return EOF;
+        }
+        return static_cast<unsigned char>(buffer[pos]);
+    }
+
+    inline bool skip_spaces() {
+        int c;
+        while ((c = peek()) != EOF && c <= ' ')
+            ++pos;
+        return c != EOF;
+    }
+
+    bool read_word(std::string& word) {
+        word.clear();
+        if (!skip_spaces())
+            return false;
+        int c;
+        while ((c = peek()) != EOF && c > ' ') {
+            word.push_back(static_cast<char>(c));
+            ++pos;
+        }
+        return true;
+    }
+
+    bool read_integer(long long& value) {
+        value = 0; // like failed iostream extraction
+        if (!skip_spaces())
+            return false;
+        bool negative = (peek() == '-');
+        if (negative || peek() == '+')
+            ++pos;
+        unsigned long long result = 0;
+        bool digits = false;
+        int c;
+        while ((c = peek()) >= '0' && c <= '9') {
+            result = result * 10 + (c - '0');
+            digits = true;
+            ++pos;
+        }
+        value = negative ? static_cast<long long>(0ULL - result) : static_cast<long long>(result);
+        return digits;
+    }
+
+public:
+    explicit text_reader(std::istream& in) : in(&in), buffer(chunk_size), pos(0), len(0), ok(true) { }
+
+    text_reader nested(std::istream& file) const {
+        return text_reader(file);
+    }
+
+    bool read_operation(std::string& operation) {
+        return ok = read_word(operation);
+    }
+
+    text_reader& operator>>(std::string& value) {
+        ok = read_word(value);
+        return *this;
+    }
+
+    text_reader& operator>>(long long& value) {
+        ok = read_integer(value);
+        return *this;
+    }
+
+    text_reader& operator>>(int& value) {
+        long long wide;
+        ok = read_integer(wide);
+        value = static_cast<int>(wide);
+        return *this;
+    }
+
+    explicit operator bool() const {
+        return ok;
+    }
+};
+
+
+/// Compact binary operation log. Every record is a one-byte operation code (the index of the
+/// operation in the driver's table) followed by its arguments in the order of the text
+/// command: int as 4 bytes, long long as 8 bytes (both little-endian, two's complement),
+/// string as a 4-byte length and the bytes themselves. The log ends with EOF or "finish".
+class binary_reader {
+    std::istream *in;
+    const std::vector<std::string> *operations;
+    bool ok;
+
+    bool read_bytes(char *dest, size_t count) {
+        return ok = (in->rdbuf()->sgetn(dest, count) == static_cast<std::streamsize>(count));
+    }
+
+    template<typename U>
+    bool read_unsigned(U& value, size_t bytes) {
+        unsigned char raw[8];
+        value = 0;
+        if (!read_bytes(reinterpret_cast<char*>(raw), bytes))
+            return false;
+        for (size_t i = bytes; i-- > 0; )
+            value = static_cast<U>((value << 8) | raw[i]);
+        return true;
+    }
+
+public:
+    binary_reader(std::istream& in, const std::vector<std::string>& operations) :
+            in(&in), operations(&operations), ok(true) { }
+
+    binary_reader nested(std::istream& file) const {
+        return binary_reader(file, *operations);
+    }
+
+    bool read_operation(std::string& operation) {
+        uint8_t code;
+        if (!read_unsigned(code, 1) || code >= operations->size())
+            return ok = false;
+        operation = (*operations)[code];
+        return true;
+    }
+
+    binary_reader& operator>>(int& value) {
+        uint32_t raw;
+        read_unsigned(raw, 4);
+        value = static_cast<int32_t>(raw);
+        return *this;
+    }
+
+    binary_reader& operator>>(long long& value) {
+        uint64_t raw;
+        read_unsigned(raw, 8);
+        value = static_cast<int64_t>(raw);
+        return *this;
+    }
+
+    binary_reader& operator>>(std::string& value) {
+        uint32_t length;
+        if (read_unsigned(length, 4)) {
+            value.resize(length);
+            if (length > 0)
+                read_bytes(&value[0], length);
+        }
+        return *this;
+    }
+
+    explicit operator bool() const {
+        return ok;
+    }
+};
+
+#endif // CLI_IO_H_INCLUDED
@@ -0,0 +1,40 @@
+#ifndef JOURNAL_H_INCLUDED
+#define JOURNAL_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+/// Journaling of the updates of the containers. A container with an attached journal (see
+/// their attach_journal()) hands it the records of every update it accepts, right after
+/// applying it, and replay() applies such records again, e.g. when recovering from a
+/// write_ahead_log.
+
+enum class journal_op : uint8_t {
+    insert = 0, erase = 1, remove = 2, clear = 3, push_back = 4, push_front = 5, pop_back = 6, pop_front = 7
+};
+
+/// One accepted update: remove is delete_operation(tm), and x is T() for the operations
+/// without an element (pops, remove and clear).
+template<typename T>
+struct journal_record {
+    journal_op op;
+    T x;
+    long long tm;
+};
+
+template<typename T>
+class retroactive_journal {
+public:
+    virtual ~retroactive_journal() { }
+
+    /// The records of one accepted update: a single one, or all the edits of a transaction,
+    /// in their order, which have to be replayed together since the history they go
+    /// through may be invalid between them.
+    virtual void record(const journal_record<T> *records, size_t count) = 0;
+
+    /// Position of the last recorded update, stored in the snapshots of the container so
+    /// that only the later records are replayed on top of them.
+    virtual uint64_t position() const = 0;
+};
+
+#endif // JOURNAL_H_INCLUDED
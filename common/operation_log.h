@@ -0,0 +1,134 @@
+#ifndef OPERATION_LOG_H_INCLUDED
+#define OPERATION_LOG_H_INCLUDED
+
+#include <cstddef>
+#include <limits>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "retroactive_stats.h"
+
+/// Log of the operations of a container: the argument of the operation at each time.
+/// Lookups by time are hashed, so they are O(1) expected instead of a tree walk. Operations
+/// at the present only append their time to a vector, and those in the past go to an
+/// ordered set. Both are needed just to know the time of the last operation.
+template<typename T>
+class operation_log {
+
+private:
+    std::unordered_map<long long, T> entries;
+    std::vector<long long> appended; // increasing; deleted operations stay as tombstones
+    std::set<long long> inserted;    // times of the operations added before the last one
+
+    inline bool alive(long long tm) const {
+        return entries.find(tm) != entries.end();
+    }
+
+    void compact() { // drops the tombstones once they outnumber the operations
+        size_t kept = 0;
+        for (size_t i = 0; i < appended.size(); ++i)
+            if (alive(appended[i]))
+                appended[kept++] = appended[i];
+        appended.resize(kept);
+    }
+
+public:
+    /*** Friend operators ***/
+    template<typename T1>
+        friend bool operator==(const operation_log<T1>& x, const operation_log<T1>& y);
+
+
+    /*** Updates ***/
+    /// Returns false if there is already an operation at that time.
+    bool insert(long long tm, const T& x) {
+        if (!entries.emplace(tm, x).second)
+            return false;
+        if (entries.size() == 1 || tm >= next_time()) // no later operation, next_time() ignores tm yet
+            appended.push_back(tm);
+        else
+            inserted.insert(tm);
+        return true;
+    }
+
+    bool erase(long long tm) {
+        if (entries.erase(tm) == 0)
+            return false;
+        inserted.erase(tm);
+        while (!appended.empty() && !alive(appended.back()))
+            appended.pop_back();
+        if (appended.size() > 2 * entries.size() + 16)
+            compact();
+        return true;
+    }
+
+    void clear() {
+        entries.clear();
+        appended.clear();
+        inserted.clear();
+    }
+
+    void swap(operation_log<T>& other) noexcept {
+        entries.swap(other.entries);
+        appended.swap(other.appended);
+        inserted.swap(other.inserted);
+    }
+
+
+    /*** Queries ***/
+    /// The argument of the operation at time tm or nullptr.
+    inline const T *find(long long tm) const {
+        auto it = entries.find(tm);
+        return it != entries.end() ? &it->second : nullptr;
+    }
+
+    inline bool contains(long long tm) const {
+        return alive(tm);
+    }
+
+    /// The time right after the last operation, or 0 for an empty log.
+    inline long long next_time() const {
+        if (entries.empty())
+            return 0;
+        long long last = appended.empty() ? std::numeric_limits<long long>::min() : appended.back();
+        if (!inserted.empty() && *inserted.rbegin() > last)
+            last = *inserted.rbegin();
+        return last + 1;
+    }
+
+    inline size_t size() const {
+        return entries.size();
+    }
+
+    inline bool empty() const {
+        return entries.empty();
+    }
+
+#ifdef RETROACTIVE_STATS
+    size_t bytes() const {
+        return entries.size() * (sizeof(std::pair<const long long, T>) + 2 * sizeof(void*)) +
+               entries.bucket_count() * sizeof(void*) + appended.capacity() * sizeof(long long) +
+               inserted.size() * retroactive_stats::tree_node_bytes<long long>();
+    }
+#endif
+};
+
+
+/*** Friend operators implementation ***/
+template<typename T>
+inline bool operator==(const operation_log<T>& x, const operation_log<T>& y) {
+    return x.entries == y.entries;
+}
+
+template<typename T>
+inline bool operator!=(const operation_log<T>& x, const operation_log<T>& y) {
+    return !(x == y);
+}
+
+template<typename T>
+inline void swap(operation_log<T>& x, operation_log<T>& y) noexcept {
+    x.swap(y);
+}
+
+#endif // OPERATION_LOG_H_INCLUDED
@@ -0,0 +1,82 @@
+#ifndef RETROACTIVE_STATS_H_INCLUDED
+#define RETROACTIVE_STATS_H_INCLUDED
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+/// Instrumentation of the containers. It is compiled in only if RETROACTIVE_STATS is defined,
+/// otherwise the containers have no stats() and RETROACTIVE_COUNT expands to nothing.
+
+#ifdef RETROACTIVE_STATS
+#define RETROACTIVE_COUNT(counter) (++(counter))
+#else
+#define RETROACTIVE_COUNT(counter) ((void)0)
+#endif
+
+/// Cumulative event counters of a container. Splits and merges count the recursive steps,
+/// i.e. the visited treap nodes, so their ratio to updates is the cost of an update.
+struct retroactive_counters {
+    unsigned long long updates;   // calls of the retroactive updates and delete_operation
+    unsigned long long rollbacks; // updates undone because they made the history invalid
+    unsigned long long splits, merges;
+
+    retroactive_counters() : updates(0), rollbacks(0), splits(0), merges(0) { }
+};
+
+/// Snapshot of the counters and of the shape of a container. Values that don't apply to a
+/// container (e.g. treap depth of a container without treaps) are 0. Sizes of the standard
+/// containers are estimates: the payload plus the usual node header of the library.
+struct retroactive_stats {
+    retroactive_counters counters;
+    size_t nodes, max_depth, total_depth; // nodes of the container's own trees
+    size_t operations_bytes, sequences_bytes, tree_bytes;
+
+    retroactive_stats() : counters(), nodes(0), max_depth(0), total_depth(0),
+            operations_bytes(0), sequences_bytes(0), tree_bytes(0) { }
+
+    inline void add_node(size_t depth) { // depth of the root is 1
+        ++nodes;
+        total_depth += depth;
+        if (depth > max_depth)
+            max_depth = depth;
+    }
+
+    inline double average_depth() const {
+        return nodes ? static_cast<double>(total_depth) / nodes : 0;
+    }
+
+    /// Calls f(name, value) for every counter, e.g. to export them to a metrics system.
+    template<typename F>
+    void for_each(F f) const {
+        f("updates", static_cast<double>(counters.updates));
+        f("rollbacks", static_cast<double>(counters.rollbacks));
+        f("splits", static_cast<double>(counters.splits));
+        f("merges", static_cast<double>(counters.merges));
+        f("nodes", static_cast<double>(nodes));
+        f("max_depth", static_cast<double>(max_depth));
+        f("average_depth", average_depth());
+        f("operations_bytes", static_cast<double>(operations_bytes));
+        f("sequences_bytes", static_cast<double>(sequences_bytes));
+        f("tree_bytes", static_cast<double>(tree_bytes));
+    }
+
+    /// Writes "<prefix>_<name> <value>" lines, the text format of most metrics collectors.
+    void write(std::ostream& out, const std::string& prefix) const {
+        for_each([&out, &prefix](const char *name, double value) {
+            out << prefix << '_' << name << ' ';
+            if (value == static_cast<double>(static_cast<long long>(value)))
+                out << static_cast<long long>(value) << '\n'; // no exponent for large counters
+            else
+                out << value << '\n';
+        });
+    }
+
+    /// Estimated size of a node of std::map or std::set with the given value type.
+    template<typename V>
+    static constexpr size_t tree_node_bytes() {
+        return sizeof(V) + 4 * sizeof(void*); // color, parent and children
+    }
+};
+
+#endif // RETROACTIVE_STATS_H_INCLUDED
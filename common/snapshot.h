@@ -0,0 +1,304 @@
+#ifndef SNAPSHOT_H_INCLUDED
+#define SNAPSHOT_H_INCLUDED
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Snapshot files of the containers (POSIX only). A snapshot is a header, a table of sections
+/// and the sections themselves, each one an array of fixed-size records of a trivially
+/// copyable type in the native byte order, aligned to 16 bytes in the file. There are no
+/// pointers, the records refer to each other by index, so a mapped file is used as it is:
+/// opening one is O(number of sections) whatever its size. The layout of the sections is up
+/// to each container, see their save_snapshot(). A file written on a machine of the other
+/// byte order or with a different size of the elements is rejected when opened. The header
+/// also keeps the position in the journal of the container (see journal.h) the snapshot
+/// covers, 0 without a journal.
+///
+///     header:   magic, version, kind, value_size, section_count, log_position (snapshot_header)
+///     table:    section_count x (offset, count, record_size) (snapshot_section)
+///     sections: the records, each section starting at its offset
+
+enum class snapshot_kind : uint32_t {
+    deque = 1, set = 2, unordered_set = 3, unordered_multiset = 4, partially_retroactive_set = 5
+};
+
+struct snapshot_header {
+    static const uint64_t magic_value = 0x31504E5354455252ULL; // "RRETSNP1" read in little-endian order
+    static const uint32_t current_version = 2;
+
+    uint64_t magic;
+    uint32_t version, kind;
+    uint32_t value_size; // sizeof the elements of the container
+    uint32_t section_count;
+    uint64_t log_position;
+};
+
+struct snapshot_section {
+    uint64_t offset, count, record_size;
+};
+
+
+/// Flushes the entry of path in its directory to the disk, which makes a rename or a new file
+/// durable.
+inline bool sync_parent_directory(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string directory = (slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash));
+    int fd = ::open(directory.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool ok = (::fsync(fd) == 0);
+    return (::close(fd) == 0) && ok;
+}
+
+
+/// Collects the sections of a snapshot and writes them. The records aren't copied, so they
+/// have to stay alive until write().
+class snapshot_writer {
+    struct pending {
+        const void *data;
+        size_t count, record_size;
+    };
+
+    snapshot_kind kind;
+    size_t value_size;
+    uint64_t log_position;
+    std::vector<pending> sections;
+
+    static const size_t alignment = 16;
+
+    static inline size_t align(size_t offset) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    static bool write_all(int fd, const void *data, size_t length) {
+        const char *bytes = static_cast<const char*>(data);
+        while (length > 0) {
+            ssize_t written = ::write(fd, bytes, length);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0)
+                return false;
+            bytes += written;
+            length -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+public:
+    snapshot_writer(snapshot_kind kind, size_t value_size, uint64_t log_position = 0) : kind(kind),
+            value_size(value_size), log_position(log_position), sections() { }
+
+    template<typename U>
+    void add(const U *data, size_t count) {
+        static_assert(std::is_trivially_copyable<U>::value, "snapshot records must be trivially copyable");
+        sections.push_back({data, count, sizeof(U)});
+    }
+
+    template<typename U>
+    void add(const std::vector<U>& records) {
+        add(records.data(), records.size());
+    }
+
+    /// Writes the snapshot to a temporary file next to path, flushes it to the disk and
+    /// renames it to path, so path holds either the old snapshot or the whole new one, even
+    /// after a crash.
+    bool write(const std::string& path) const {
+        snapshot_header header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = snapshot_header::magic_value;
+        header.version = snapshot_header::current_version;
+        header.kind = static_cast<uint32_t>(kind);
+        header.value_size = static_cast<uint32_t>(value_size);
+        header.section_count = static_cast<uint32_t>(sections.size());
+        header.log_position = log_position;
+
+        std::vector<snapshot_section> table(sections.size());
+        size_t offset = align(sizeof(header) + table.size() * sizeof(snapshot_section));
+        for (size_t i = 0; i < sections.size(); ++i) {
+            table[i] = {offset, sections[i].count, sections[i].record_size};
+            offset = align(offset + sections[i].count * sections[i].record_size);
+        }
+
+        std::string temporary = path + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        static const char padding[alignment] = { };
+        size_t written = sizeof(header) + table.size() * sizeof(snapshot_section);
+        bool ok = write_all(fd, &header, sizeof(header)) &&
+                  write_all(fd, table.data(), table.size() * sizeof(snapshot_section));
+        for (size_t i = 0; i < sections.size() && ok; ++i) {
+            ok = write_all(fd, padding, table[i].offset - written) &&
+                 write_all(fd, sections[i].data, sections[i].count * sections[i].record_size);
+            written = table[i].offset + sections[i].count * sections[i].record_size;
+        }
+        ok = ok && ::fsync(fd) == 0;
+        ok = (::close(fd) == 0) && ok;
+        if (!ok || ::rename(temporary.c_str(), path.c_str()) != 0) {
+            ::unlink(temporary.c_str());
+            return false;
+        }
+        return sync_parent_directory(path);
+    }
+};
+
+
+/// Whether offsets[0..count) split total records into count - 1 consecutive ranges, the i-th
+/// one being [offsets[i], offsets[i + 1]).
+inline bool snapshot_offsets_valid(const uint64_t *offsets, size_t count, size_t total) {
+    if (count == 0 || offsets[0] != 0 || offsets[count - 1] != total)
+        return false;
+    for (size_t i = 1; i < count; ++i)
+        if (offsets[i] < offsets[i - 1])
+            return false;
+    return true;
+}
+
+
+/// Whether each operation (times[i], values[i]) of the log of a snapshot is in the history
+/// of its element, found by binary searches: the keys have to be increasing, and so do the
+/// times of the history of the k-th key, [offsets[k], offsets[k + 1]) of history_times. With
+/// no time twice in the log and as many operations in it as in the histories, the log and
+/// the histories then hold the same operations.
+template<typename T>
+bool snapshot_log_matches(const long long *times, const T *values, size_t n, const T *keys, size_t key_count,
+                          const uint64_t *offsets, const long long *history_times) {
+    for (size_t i = 0; i < n; ++i) {
+        const T *key = std::lower_bound(keys, keys + key_count, values[i]);
+        if (key == keys + key_count || values[i] < *key)
+            return false;
+        const long long *first = history_times + offsets[key - keys], *last = history_times + offsets[key - keys + 1];
+        const long long *tm = std::lower_bound(first, last, times[i]);
+        if (tm == last || *tm != times[i])
+            return false;
+    }
+    return true;
+}
+
+
+/// Reads the log_position of the snapshot at path without mapping it.
+inline bool snapshot_log_position(const std::string& path, uint64_t& position) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    snapshot_header header;
+    bool ok = ::read(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header)) &&
+              header.magic == snapshot_header::magic_value && header.version == snapshot_header::current_version;
+    ::close(fd);
+    if (ok)
+        position = header.log_position;
+    return ok;
+}
+
+
+/// A snapshot mapped read-only into memory. The sections point into the mapping, so they are
+/// valid as long as the snapshot_file stays open.
+class snapshot_file {
+    const char *base;
+    size_t length;
+
+public:
+    snapshot_file() : base(nullptr), length(0) { }
+
+    snapshot_file(const snapshot_file&) = delete;
+    snapshot_file& operator=(const snapshot_file&) = delete;
+
+    snapshot_file(snapshot_file&& other) noexcept : base(other.base), length(other.length) {
+        other.base = nullptr;
+        other.length = 0;
+    }
+
+    snapshot_file& operator=(snapshot_file&& other) noexcept {
+        if (this != &other) {
+            close();
+            base = other.base;
+            length = other.length;
+            other.base = nullptr;
+            other.length = 0;
+        }
+        return *this;
+    }
+
+    ~snapshot_file() {
+        close();
+    }
+
+    /// Maps the file and checks its header and that all the sections lie inside of it.
+    bool open(const std::string& path, snapshot_kind kind, size_t value_size) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        void *mapped = MAP_FAILED;
+        if (::fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(snapshot_header))
+            mapped = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd); // the mapping stays
+        if (mapped == MAP_FAILED)
+            return false;
+        base = static_cast<const char*>(mapped);
+        length = static_cast<size_t>(info.st_size);
+
+        const snapshot_header *header = reinterpret_cast<const snapshot_header*>(base);
+        bool ok = header->magic == snapshot_header::magic_value && header->version == snapshot_header::current_version &&
+                  header->kind == static_cast<uint32_t>(kind) && header->value_size == value_size &&
+                  header->section_count <= (length - sizeof(snapshot_header)) / sizeof(snapshot_section);
+        for (size_t i = 0; ok && i < header->section_count; ++i) {
+            const snapshot_section& s = table()[i];
+            ok = s.offset % 16 == 0 && s.offset <= length && s.record_size > 0 &&
+                 s.count <= (length - s.offset) / s.record_size;
+        }
+        if (!ok)
+            close();
+        return ok;
+    }
+
+    void close() {
+        if (base)
+            ::munmap(const_cast<char*>(base), length);
+        base = nullptr;
+        length = 0;
+    }
+
+    inline bool is_open() const {
+        return base != nullptr;
+    }
+
+    inline uint64_t log_position() const {
+        return base ? reinterpret_cast<const snapshot_header*>(base)->log_position : 0;
+    }
+
+    inline size_t sections() const {
+        return base ? reinterpret_cast<const snapshot_header*>(base)->section_count : 0;
+    }
+
+    /// The records of the i-th section, or false if there is no such section or its records
+    /// aren't of type U.
+    template<typename U>
+    bool section(size_t i, const U *& records, size_t& count) const {
+        static_assert(std::is_trivially_copyable<U>::value, "snapshot records must be trivially copyable");
+        if (i >= sections() || table()[i].record_size != sizeof(U))
+            return false;
+        records = reinterpret_cast<const U*>(base + table()[i].offset);
+        count = static_cast<size_t>(table()[i].count);
+        return true;
+    }
+
+private:
+    inline const snapshot_section *table() const {
+        return reinterpret_cast<const snapshot_section*>(base + sizeof(snapshot_header));
+    }
+};
+
+#endif // SNAPSHOT_H_INCLUDED
@@ -0,0 +1,396 @@
+#ifndef WRITE_AHEAD_LOG_H_INCLUDED
+#define WRITE_AHEAD_LOG_H_INCLUDED
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "snapshot.h"
+
+/// Append-only log of the updates accepted by a container (POSIX only, build with -pthread),
+/// attached to it as its journal. Recording an update only buffers it; commit() makes the
+/// records durable with a group commit: the first thread to commit writes and syncs everything
+/// recorded so far, and the threads committing meanwhile wait for it and are covered by the
+/// same sync (or the next one), so a sync is shared by all the updates recorded since the
+/// previous one. Together with the snapshots of the container it gives fast recovery (see
+/// recover() and checkpoint() below): the latest snapshot records the position in the log it
+/// covers, so only the later records are replayed.
+///
+///     header:  magic, version, value_size, start (log_header), start being the position of
+///              the last record before the log, 0 for a new one
+///     records: fixed-size log_entry, with positions start + 1, start + 2, ...
+///
+/// A transaction is a marker record with the number of its edits in tm, followed by them. Each
+/// record carries a checksum, so a record torn by a crash ends the log, and a transaction cut
+/// off by it is dropped as a whole. Like the snapshots, logs aren't portable between machines.
+template<typename T>
+class write_ahead_log : public retroactive_journal<T> {
+    static_assert(std::is_trivially_copyable<T>::value, "logged elements must be trivially copyable");
+
+public:
+    enum : uint32_t { transaction = 0xFF }; // op of the marker records
+
+    struct log_header {
+        static const uint64_t magic_value = 0x314C415754455252ULL; // "RRETWAL1" read in little-endian order
+        static const uint32_t current_version = 1;
+
+        uint64_t magic;
+        uint32_t version;
+        uint32_t value_size;
+        uint64_t start;
+    };
+
+    struct log_entry {
+        uint64_t position;
+        long long tm;
+        T x;
+        uint32_t op;
+        uint32_t checksum; // of the bytes before it
+    };
+
+private:
+    static const size_t write_threshold = 4096; // records buffered before they are written out without a sync
+    static const size_t read_batch = 4096;
+
+    std::string path;
+    int fd;
+    mutable std::mutex lock;
+    std::condition_variable flushed;
+    std::vector<log_entry> pending; // recorded, not written yet
+    uint64_t appended, durable;     // positions of the last recorded and of the last synced record
+    bool flushing, failed;
+
+    static uint32_t checksum(const log_entry& e) { // FNV-1a
+        const unsigned char *bytes = reinterpret_cast<const unsigned char*>(&e);
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < offsetof(log_entry, checksum); ++i)
+            h = (h ^ bytes[i]) * 16777619u;
+        return h;
+    }
+
+    static bool write_all(int fd, const void *data, size_t length) {
+        const char *bytes = static_cast<const char*>(data);
+        while (length > 0) {
+            ssize_t written = ::write(fd, bytes, length);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0)
+                return false;
+            bytes += written;
+            length -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    /// Reads up to length bytes, fewer only at the end of the file; -1 on an error.
+    static ssize_t read_all(int fd, void *data, size_t length) {
+        char *bytes = static_cast<char*>(data);
+        size_t done = 0;
+        while (done < length) {
+            ssize_t got = ::read(fd, bytes + done, length - done);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                return -1;
+            if (got == 0)
+                break;
+            done += static_cast<size_t>(got);
+        }
+        return static_cast<ssize_t>(done);
+    }
+
+    static log_header make_header(uint64_t start) {
+        log_header h;
+        std::memset(&h, 0, sizeof(h));
+        h.magic = log_header::magic_value;
+        h.version = log_header::current_version;
+        h.value_size = sizeof(T);
+        h.start = start;
+        return h;
+    }
+
+    static inline bool header_valid(const log_header& h) {
+        return h.magic == log_header::magic_value && h.version == log_header::current_version && h.value_size == sizeof(T);
+    }
+
+    /// Calls visit on the intact records of a log read from after its header, in order, up to
+    /// the first torn one; last gets the position of the last one. False if the file can't be
+    /// read or visit returns false.
+    template<typename Visit>
+    static bool scan(int fd, uint64_t start, Visit visit, uint64_t& last) {
+        std::vector<log_entry> batch(read_batch);
+        last = start;
+        while (true) {
+            ssize_t got = read_all(fd, batch.data(), batch.size() * sizeof(log_entry));
+            if (got < 0)
+                return false;
+            size_t count = static_cast<size_t>(got) / sizeof(log_entry);
+            for (size_t i = 0; i < count; ++i) {
+                if (batch[i].position != last + 1 || batch[i].checksum != checksum(batch[i]))
+                    return true;
+                if (!visit(batch[i]))
+                    return false;
+                ++last;
+            }
+            if (count < batch.size())
+                return true;
+        }
+    }
+
+    /// Writes out the pending records, then syncs the file if sync. The lock is held on entry
+    /// and on exit but not during the I/O, so other threads keep recording meanwhile (their
+    /// records make the next group), and only one thread does I/O at a time (flushing).
+    bool write_pending(std::unique_lock<std::mutex>& guard, bool sync) {
+        std::vector<log_entry> group;
+        group.swap(pending);
+        uint64_t upto = appended;
+        flushing = true;
+        guard.unlock();
+        bool ok = write_all(fd, group.data(), group.size() * sizeof(log_entry)) && (!sync || ::fdatasync(fd) == 0);
+        guard.lock();
+        flushing = false;
+        if (!ok)
+            failed = true; // what was written is unknown, so the log takes no more records
+        else if (sync)
+            durable = upto;
+        flushed.notify_all();
+        return ok;
+    }
+
+    /// Waits until no thread does I/O, with the lock held.
+    void wait_flush(std::unique_lock<std::mutex>& guard) {
+        while (flushing)
+            flushed.wait(guard);
+    }
+
+public:
+    write_ahead_log<T>() : path(), fd(-1), lock(), flushed(), pending(), appended(0), durable(0), flushing(false),
+            failed(false) { }
+
+    write_ahead_log<T>(const write_ahead_log<T>&) = delete;
+    write_ahead_log<T>& operator=(const write_ahead_log<T>&) = delete;
+
+    /// Commits what was recorded. The log must be detached from its container.
+    ~write_ahead_log<T>() {
+        close();
+    }
+
+    /// Opens the log at log_path, creating it if needed, and continues after its last intact
+    /// record: a tail torn by a crash is cut off, along with the intact edits of a transaction
+    /// whose later edits were torn, which the next records would otherwise join.
+    bool open(const std::string& log_path) {
+        close();
+        int file = ::open(log_path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (file < 0)
+            return false;
+        log_header h;
+        ssize_t got = read_all(file, &h, sizeof(h));
+        bool ok;
+        if (got == 0) { // a new log
+            h = make_header(0);
+            ok = write_all(file, &h, sizeof(h)) && ::fsync(file) == 0 && sync_parent_directory(log_path);
+        } else {
+            ok = got == static_cast<ssize_t>(sizeof(h)) && header_valid(h);
+        }
+
+        uint64_t last = h.start, marker = 0;
+        size_t missing = 0; // edits of the last transaction still to come, see read()
+        ok = ok && scan(file, h.start, [&](const log_entry& e) {
+            if (e.op == transaction) {
+                marker = e.position;
+                missing = static_cast<size_t>(e.tm);
+            } else if (missing > 0)
+                --missing;
+            return true;
+        }, last);
+        if (missing > 0)
+            last = marker - 1;
+        off_t end = static_cast<off_t>(sizeof(h) + (last - h.start) * sizeof(log_entry));
+        ok = ok && ::ftruncate(file, end) == 0 && ::lseek(file, end, SEEK_SET) == end;
+        if (!ok) {
+            ::close(file);
+            return false;
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        path = log_path;
+        fd = file;
+        appended = durable = last;
+        failed = false;
+        return true;
+    }
+
+    /// Commits what was recorded and closes the log.
+    void close() {
+        if (fd < 0)
+            return;
+        commit();
+        std::unique_lock<std::mutex> guard(lock);
+        wait_flush(guard);
+        ::close(fd);
+        fd = -1;
+        pending.clear();
+        appended = durable = 0;
+    }
+
+    inline bool is_open() const {
+        return fd >= 0;
+    }
+
+    /// Called by the container: buffers the records, and writes them out without a sync once
+    /// there are many of them. Thread-safe.
+    void record(const journal_record<T> *records, size_t count) override {
+        std::unique_lock<std::mutex> guard(lock);
+        if (fd < 0 || failed)
+            return;
+        for (size_t i = (count > 1 ? 0 : 1); i <= count; ++i) { // i == 0 is the marker of a transaction
+            log_entry e;
+            std::memset(&e, 0, sizeof(e));
+            e.position = ++appended;
+            e.tm = (i == 0 ? static_cast<long long>(count) : records[i - 1].tm);
+            if (i > 0)
+                e.x = records[i - 1].x;
+            e.op = (i == 0 ? static_cast<uint32_t>(transaction) : static_cast<uint32_t>(records[i - 1].op));
+            e.checksum = checksum(e);
+            pending.push_back(e);
+        }
+        if (pending.size() >= write_threshold && !flushing)
+            write_pending(guard, false);
+    }
+
+    uint64_t position() const override {
+        std::lock_guard<std::mutex> guard(lock);
+        return appended;
+    }
+
+    /// Makes the records up to position upto durable, waiting for the sync of another thread
+    /// if it covers them. False if the log failed (or was never opened) before that.
+    bool commit(uint64_t upto) {
+        std::unique_lock<std::mutex> guard(lock);
+        while (durable < upto && !failed && fd >= 0) {
+            if (flushing)
+                flushed.wait(guard); // its group may not reach upto, check again
+            else
+                write_pending(guard, true);
+        }
+        return durable >= upto;
+    }
+
+    /// Makes everything recorded so far durable.
+    bool commit() {
+        return commit(position());
+    }
+
+    /// Drops all the records, once a snapshot covering them up to position covered is written
+    /// (see checkpoint()); false if there are records after covered. The new, empty log
+    /// replaces the old one atomically, and keeps counting positions.
+    bool reset(uint64_t covered) {
+        if (!commit())
+            return false;
+        std::unique_lock<std::mutex> guard(lock);
+        wait_flush(guard);
+        if (fd < 0 || failed || durable != appended || appended != covered)
+            return false; // records came in since the snapshot, which doesn't cover them
+
+        std::string temporary = path + ".tmp";
+        int file = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file < 0)
+            return false;
+        log_header h = make_header(appended);
+        bool ok = write_all(file, &h, sizeof(h)) && ::fsync(file) == 0;
+        if (!ok || ::rename(temporary.c_str(), path.c_str()) != 0) {
+            ::close(file);
+            ::unlink(temporary.c_str());
+            return false;
+        }
+        ::close(fd);
+        fd = file;
+        if (!sync_parent_directory(path))
+            failed = true; // the old log may come back after a crash, with records the snapshot covers
+        return !failed;
+    }
+
+    /// Calls apply(records) for each update logged after position after, in order, with the
+    /// vector of its records (a single one, or the edits of a transaction). A missing log is an
+    /// empty one. False if the log can't be read, misses records after after, or apply returns
+    /// false.
+    template<typename Apply>
+    static bool read(const std::string& log_path, uint64_t after, Apply apply) {
+        int file = ::open(log_path.c_str(), O_RDONLY);
+        if (file < 0)
+            return errno == ENOENT;
+        log_header h;
+        bool ok = read_all(file, &h, sizeof(h)) == static_cast<ssize_t>(sizeof(h)) && header_valid(h) && h.start <= after;
+
+        std::vector<journal_record<T>> update;
+        size_t missing = 0; // edits of the current transaction still to come
+        uint64_t last;
+        ok = ok && scan(file, h.start, [&](const log_entry& e) {
+            if (e.op == transaction) {
+                update.clear();
+                missing = static_cast<size_t>(e.tm);
+                return true;
+            }
+            update.push_back({static_cast<journal_op>(e.op), e.x, e.tm});
+            if (missing > 1) {
+                --missing;
+                return true;
+            }
+            missing = 0;
+            bool applied = (e.position <= after || apply(update));
+            update.clear();
+            return applied;
+        }, last);
+        ::close(file);
+        return ok && last >= after;
+    }
+};
+
+
+/// Replays into c the updates logged after position after, e.g. into an empty container from
+/// the start of a log that was never reset. Call it before attaching a journal to c.
+template<typename Container>
+bool replay_log(Container& c, const std::string& log_path, uint64_t after = 0) {
+    typedef typename Container::value_type T;
+    return write_ahead_log<T>::read(log_path, after, [&c](const std::vector<journal_record<T>>& update) {
+        return c.replay(update);
+    });
+}
+
+/// Recovers c from the latest snapshot written by checkpoint() (nothing if there is none yet)
+/// and the log: O(size of the snapshot) to load it, then only the later updates are replayed.
+/// Call it before opening the log and attaching it to c.
+template<typename Container>
+bool recover(Container& c, const std::string& snapshot_path, const std::string& log_path) {
+    uint64_t after = 0;
+    if (::access(snapshot_path.c_str(), F_OK) == 0) {
+        if (!c.load_snapshot(snapshot_path) || !snapshot_log_position(snapshot_path, after))
+            return false;
+    } else {
+        c.clear();
+    }
+    return replay_log(c, log_path, after);
+}
+
+/// Writes a snapshot of c, attached to log, and drops the records of the log it covers, which
+/// bounds both the log and the time to recover. If updates come in meanwhile (only possible
+/// with concurrent_retroactive_unordered_set), the log is kept and false returned, but the
+/// snapshot is still good: recover() skips the records it covers.
+template<typename Container, typename T>
+bool checkpoint(const Container& c, write_ahead_log<T>& log, const std::string& snapshot_path) {
+    uint64_t covered;
+    return log.commit() && c.save_snapshot(snapshot_path) && snapshot_log_position(snapshot_path, covered) &&
+           log.reset(covered);
+}
+
+#endif // WRITE_AHEAD_LOG_H_INCLUDED
@@ -0,0 +1,81 @@
+#include <iostream>
+#include <map>
+#include <utility>
+
+#include "../common/benchmark.h"
+#include "partially_retroactive_set.h"
+
+using namespace std;
+
+/// Updates are insertions (add) or erasures of the value. Queries are finds at the present,
+/// whatever their time, since the set is only partially retroactive.
+struct partially_set_subject {
+    partially_retroactive_set<int> s;
+
+    static const char *name() {
+        return "retroactive";
+    }
+
+    long long apply(const workload_op& op) {
+        switch (op.kind) {
+        case workload_op::update:
+            return op.add ? s.insert(op.value, op.tm) : s.erase(op.value, op.tm);
+        case workload_op::remove:
+            return s.delete_operation(op.tm);
+        default:
+            return s.find(op.value);
+        }
+    }
+};
+
+/// Keeps the log of operations only and scans it for every query and update. The operations
+/// on each element must alternate between insertions and erasures in time order, and only
+/// the last one of them may be deleted.
+struct partially_set_baseline {
+    map<long long, pair<int, bool>> log; // time -> (element, is insert operation)
+
+    static const char *name() {
+        return "naive replay";
+    }
+
+    pair<long long, long long> events(int x) const { // number and time of the last of them
+        pair<long long, long long> ans(0, -1);
+        for (auto it = log.begin(); it != log.end(); ++it)
+            if (it->second.first == x)
+                ans = make_pair(ans.first + 1, it->first);
+        return ans;
+    }
+
+    long long apply(const workload_op& op) {
+        switch (op.kind) {
+        case workload_op::update: {
+            if (log.count(op.tm))
+                return false;
+            pair<long long, long long> seq = events(op.value);
+            if ((seq.first % 2 == 0) != op.add || seq.second > op.tm)
+                return false;
+            log.emplace(op.tm, make_pair(op.value, op.add));
+            return true;
+        }
+        case workload_op::remove: {
+            auto it = log.find(op.tm);
+            if (it == log.end() || events(it->second.first).second != op.tm)
+                return false;
+            log.erase(it);
+            return true;
+        }
+        default:
+            return events(op.value).first % 2 != 0;
+        }
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    benchmark_options options;
+    if (!parse_benchmark_options(argc, argv, options)) {
+        cerr << "usage: " << argv[0] << " [--ops N,...] [--mix NAME,...] [--seed S] [--keys K] [--baseline-limit N]" << endl;
+        return 2;
+    }
+    return benchmark_suite<partially_set_baseline, partially_set_subject>::run(options);
+}
@@ -4,21 +4,53 @@
 #include <algorithm>
 #include <map>
 #include <set>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "../common/journal.h"
+#include "../common/operation_log.h"
+#include "../common/retroactive_stats.h"
+#include "../common/snapshot.h"
+
 template<typename T>
 class partially_retroactive_set {
 
 private:
-    std::map<long long, T> operations;
+    operation_log<T> operations;
     std::map<T, std::vector<long long>> sequences;
     std::set<T> elements;
+    retroactive_journal<T> *journal; // nullptr if none is attached
+#ifdef RETROACTIVE_STATS
+    retroactive_counters counters;
+#endif
 
     inline long long get_last_time() {
-        return operations.empty() ? 0 : operations.rbegin()->first + 1;
+        return operations.next_time();
+    }
+
+    inline void log_update(journal_op op, const T& x, long long tm) {
+        if (journal) {
+            journal_record<T> update = {op, x, tm};
+            journal->record(&update, 1);
+        }
+    }
+
+    /// clear() without recording it, for the moved-from containers.
+    void clear_contents() {
+        operations.clear();
+        sequences.clear();
+        elements.clear();
     }
 
 public:
+    typedef T value_type;
+
+    /// Sections of the snapshots, see save_snapshot().
+    enum snapshot_section {
+        section_times, section_values
+    };
+
     /*** Friend operators ***/
     template<typename T1>
         friend bool operator==(const partially_retroactive_set<T1>& x, const partially_retroactive_set<T1>& y);
@@ -27,14 +59,20 @@ public:
 
 
     /*** Constructors and destructor ***/
-    partially_retroactive_set<T>() : operations(), sequences(), elements() { }
+    partially_retroactive_set<T>() : operations(), sequences(), elements(), journal(nullptr) { }
 
-    partially_retroactive_set<T>(const partially_retroactive_set<T>& other) {
+    partially_retroactive_set<T>(const partially_retroactive_set<T>& other) : journal(nullptr) {
         operations = other.operations;
-        sequences = other.sequence;
+        sequences = other.sequences;
         elements = other.elements;
     }
 
+    partially_retroactive_set<T>(partially_retroactive_set<T>&& other) noexcept :
+            operations(std::move(other.operations)), sequences(std::move(other.sequences)),
+            elements(std::move(other.elements)), journal(nullptr) {
+        other.clear_contents();
+    }
+
     ~partially_retroactive_set<T>() { }
 
 
@@ -46,51 +84,74 @@ public:
         return *this;
     }
 
+    partially_retroactive_set<T>& operator=(partially_retroactive_set<T>&& other) noexcept {
+        if (this == &other)
+            return *this;
+        swap(other);
+        other.clear_contents();
+        return *this;
+    }
+
+    void swap(partially_retroactive_set<T>& other) noexcept {
+        operations.swap(other.operations);
+        std::swap(sequences, other.sequences);
+        std::swap(elements, other.elements);
+#ifdef RETROACTIVE_STATS
+        std::swap(counters, other.counters);
+#endif
+    }
+
 
     /*** Retroactive updates and queries ***/
     bool insert(const T& x, long long tm) {
-        if (operations.find(tm) != operations.end())
+        RETROACTIVE_COUNT(counters.updates);
+        if (operations.contains(tm))
             return false;
 
         std::vector<long long>& events = sequences[x];
         if (events.size() % 2 != 0 || (!events.empty() && events.back() > tm))
             return false;
 
-        operations[tm] = x;
+        operations.insert(tm, x);
         elements.insert(x);
         events.push_back(tm);
+        log_update(journal_op::insert, x, tm);
         return true;
     }
 
     bool erase(const T& x, long long tm) {
-        if (operations.find(tm) != operations.end())
+        RETROACTIVE_COUNT(counters.updates);
+        if (operations.contains(tm))
             return false;
 
         std::vector<long long>& events = sequences[x];
         if (events.size() % 2 == 0 || events.back() > tm)
             return false;
 
-        operations[tm] = x;
+        operations.insert(tm, x);
         elements.erase(x);
         events.push_back(tm);
+        log_update(journal_op::erase, x, tm);
         return true;
     }
 
     bool delete_operation(long long tm) {
-        auto it = operations.find(tm);
-        if (it == operations.end())
+        RETROACTIVE_COUNT(counters.updates);
+        const T *x = operations.find(tm);
+        if (!x)
             return false;
 
-        std::vector<long long>& events = sequences[it->second];
+        std::vector<long long>& events = sequences[*x];
         if (events.back() != tm) // we can delete only last operation for each element
             return false;
 
         events.pop_back();
         if (events.size() % 2 != 0) // delete "erase" operation
-            elements.insert(it->second);
+            elements.insert(*x);
         else
-            elements.erase(it->second);
-        operations.erase(it);
+            elements.erase(*x);
+        operations.erase(tm);
+        log_update(journal_op::remove, T(), tm);
         return true;
     }
 
@@ -117,10 +178,104 @@ public:
     }
 
     void clear() {
-        operations.clear();
-        sequences.clear();
-        elements.clear();
+        clear_contents();
+        log_update(journal_op::clear, T(), 0);
+    }
+
+
+    /*** Journal ***/
+    /// Hands every accepted update to journal from now on (see journal.h), nullptr detaches
+    /// it. The journal stays with this set: it isn't copied, moved or swapped, and
+    /// assignments, swaps and load_snapshot() aren't recorded.
+    void attach_journal(retroactive_journal<T> *j) {
+        journal = j;
+    }
+
+    /// Applies the records of an update again, false if one of them is rejected.
+    bool replay(const std::vector<journal_record<T>>& update) {
+        for (const journal_record<T>& r : update) {
+            if (r.op == journal_op::clear)
+                clear();
+            else if (!(r.op == journal_op::insert ? insert(r.x, r.tm) :
+                       r.op == journal_op::erase ? erase(r.x, r.tm) :
+                       r.op == journal_op::remove && delete_operation(r.tm)))
+                return false;
+        }
+        return true;
+    }
+
+
+    /*** Snapshots ***/
+    /// Writes a snapshot (see snapshot.h) of the set, whose elements have to be trivially
+    /// copyable: its operations in time order (times, values), along with the position of the
+    /// journal. Those of each element alternate between insertions and erasures, so the kinds
+    /// aren't stored.
+    bool save_snapshot(const std::string& path) const {
+        std::vector<std::pair<long long, const T*>> order;
+        for (auto it = sequences.begin(); it != sequences.end(); ++it)
+            for (long long tm : it->second)
+                order.push_back({tm, &it->first});
+        std::sort(order.begin(), order.end(), [](const std::pair<long long, const T*>& a,
+                                                 const std::pair<long long, const T*>& b) {
+            return a.first < b.first;
+        });
+        std::vector<long long> times;
+        std::vector<T> values;
+        for (const std::pair<long long, const T*>& op : order) {
+            times.push_back(op.first);
+            values.push_back(*op.second);
+        }
+
+        snapshot_writer writer(snapshot_kind::partially_retroactive_set, sizeof(T), journal ? journal->position() : 0);
+        writer.add(times);
+        writer.add(values);
+        return writer.write(path);
     }
+
+    /// Replaces the contents of the set with a snapshot, appending each operation to the
+    /// events of its element without the checks of insert() and erase(). Returns false and
+    /// leaves the set as it was if the file can't be read or isn't a snapshot of a
+    /// partially_retroactive_set<T>.
+    bool load_snapshot(const std::string& path) {
+        snapshot_file file;
+        const long long *times;
+        const T *values;
+        size_t n, value_count;
+        if (!file.open(path, snapshot_kind::partially_retroactive_set, sizeof(T)) ||
+                !file.section(section_times, times, n) || !file.section(section_values, values, value_count) ||
+                value_count != n)
+            return false;
+
+        partially_retroactive_set<T> loaded;
+        for (size_t i = 0; i < n; ++i) {
+            if (i > 0 && times[i] <= times[i - 1])
+                return false;
+            loaded.sequences[values[i]].push_back(times[i]);
+            loaded.operations.insert(times[i], values[i]);
+        }
+        for (auto it = loaded.sequences.begin(); it != loaded.sequences.end(); ++it)
+            if (it->second.size() % 2 != 0)
+                loaded.elements.emplace_hint(loaded.elements.end(), it->first);
+#ifdef RETROACTIVE_STATS
+        loaded.counters = counters;
+#endif
+        swap(loaded);
+        return true;
+    }
+
+#ifdef RETROACTIVE_STATS
+    /// Bytes of the event lists of the elements; the tree is the set of present elements.
+    retroactive_stats stats() const {
+        retroactive_stats s;
+        s.counters = counters;
+        s.operations_bytes = operations.bytes();
+        for (auto it = sequences.begin(); it != sequences.end(); ++it)
+            s.sequences_bytes += retroactive_stats::tree_node_bytes<std::pair<const T, std::vector<long long>>>() +
+                                 it->second.capacity() * sizeof(long long);
+        s.tree_bytes = elements.size() * retroactive_stats::tree_node_bytes<T>();
+        return s;
+    }
+#endif
 };
 
 
@@ -135,4 +290,9 @@ inline bool operator!=(const partially_retroactive_set<T>& x, const partially_re
     return !(x == y);
 }
 
+template<class T>
+inline void swap(partially_retroactive_set<T>& x, partially_retroactive_set<T>& y) noexcept {
+    x.swap(y);
+}
+
 #endif // PARTIALLY_RETROACTIVE_SET_H_INCLUDED
@@ -0,0 +1,114 @@
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <map>
+
+#include "../common/benchmark.h"
+#include "retroactive_deque.h"
+
+using namespace std;
+
+/// Updates are pushes (add) or pops, to the back (side) or to the front. Queries read the
+/// back (side) or the front at their time.
+struct deque_subject {
+    retroactive_deque<int> q;
+
+    static const char *name() {
+        return "retroactive";
+    }
+
+    long long apply(const workload_op& op) {
+        switch (op.kind) {
+        case workload_op::update:
+            if (op.add)
+                return op.side ? q.insert_push_back(op.value, op.tm) : q.insert_push_front(op.value, op.tm);
+            return op.side ? q.insert_pop_back(op.tm) : q.insert_pop_front(op.tm);
+        case workload_op::remove:
+            return q.delete_operation(op.tm);
+        default:
+            return op.side ? q.back(op.tm) : q.front(op.tm);
+        }
+    }
+};
+
+/// Keeps the log of operations only and replays it on a std::deque for every query, and up
+/// to the end for every update to check that no pop happens on an empty deque.
+struct deque_baseline {
+    struct operation {
+        bool push, back_op;
+        int value;
+    };
+
+    map<long long, operation> log;
+
+    static const char *name() {
+        return "naive replay";
+    }
+
+    bool replay(long long tm, deque<int>& items) const {
+        for (auto it = log.begin(); it != log.end() && it->first <= tm; ++it) {
+            const operation& op = it->second;
+            if (op.push) {
+                if (op.back_op)
+                    items.push_back(op.value);
+                else
+                    items.push_front(op.value);
+            } else if (items.empty())
+                return false;
+            else if (op.back_op)
+                items.pop_back();
+            else
+                items.pop_front();
+        }
+        return true;
+    }
+
+    bool valid() const {
+        deque<int> items;
+        return replay(numeric_limits<long long>::max(), items);
+    }
+
+    long long apply(const workload_op& op) {
+        switch (op.kind) {
+        case workload_op::update: {
+            if (log.count(op.tm))
+                return false;
+            auto it = log.emplace(op.tm, operation{op.add, op.side, op.value}).first;
+            if (!valid()) {
+                log.erase(it);
+                return false;
+            }
+            return true;
+        }
+        case workload_op::remove: {
+            auto it = log.find(op.tm);
+            if (it == log.end())
+                return false;
+            operation removed = it->second;
+            log.erase(it);
+            if (!valid()) {
+                log.emplace(op.tm, removed);
+                return false;
+            }
+            return true;
+        }
+        default: {
+            deque<int> items;
+            replay(op.tm, items);
+            if (items.empty())
+                return 0;
+            return op.side ? items.back() : items.front();
+        }
+        }
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    benchmark_options options;
+    if (!parse_benchmark_options(argc, argv, options)) {
+        cerr << "usage: " << argv[0] << " [--ops N,...] [--mix NAME,...] [--seed S] [--keys K] [--baseline-limit N]" << endl;
+        return 2;
+    }
+    return benchmark_suite<deque_baseline, deque_subject>::run(options);
+}
@@ -1,12 +1,24 @@
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <string>
+#include <vector>
 
+#include "../common/cli_io.h"
 #include "retroactive_deque.h"
 
 using namespace std;
 
-void run(istream& cin, bool allow_files = false) {
+/// Operation codes of the binary log (see binary_reader): the index of each command.
+const vector<string> binary_operations = {
+    "finish", "push_back", "push_back_retro", "push_front", "push_front_retro", "pop_back",
+    "pop_back_retro", "pop_front", "pop_front_retro", "delete_operation", "back", "back_retro",
+    "front", "front_retro", "size", "run", "clear", "stats", "at", "at_retro", "size_retro",
+    "contents", "contents_retro", "transaction", "save", "load"
+};
+
+template<typename Input>
+void run(Input& cin, bool allow_files = false) {
 
     retroactive_deque<int> q;
 
@@ -14,97 +26,188 @@ void run(istream& cin, bool allow_files = false) {
     int x;
     long long tm;
 
-    while ((cin >> operation) && operation != "finish") {
+    while (cin.read_operation(operation) && operation != "finish") {
         if (operation == "push_back") {
             cin >> x;
             long long insert_time = q.push_back(x);
-            cout << insert_time << endl;
+            cout << insert_time << '\n';
 
         } else if (operation == "push_back_retro") {
             cin >> x >> tm;
             bool success = q.insert_push_back(x, tm);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "push_front") {
             cin >> x;
             long long insert_time = q.push_front(x);
-            cout << insert_time << endl;
+            cout << insert_time << '\n';
 
         } else if (operation == "push_front_retro") {
             cin >> x >> tm;
             bool success = q.insert_push_front(x, tm);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "pop_back") {
             if (q.empty())
-                cout << "not ok" << endl;
+                cout << "not ok" << '\n';
             else {
                 long long insert_time = q.pop_back();
-                cout << insert_time << endl;
+                cout << insert_time << '\n';
             }
 
         } else if (operation == "pop_back_retro") {
             cin >> tm;
             bool success = q.insert_pop_back(tm);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "pop_front") {
             if (q.empty())
-                cout << "not ok" << endl;
+                cout << "not ok" << '\n';
             else {
                 long long insert_time = q.pop_front();
-                cout << insert_time << endl;
+                cout << insert_time << '\n';
             }
 
         } else if (operation == "pop_front_retro") {
             cin >> tm;
             bool success = q.insert_pop_front(tm);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "delete_operation") {
             cin >> tm;
             bool success = q.delete_operation(tm);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "back") {
             if (q.empty())
-                cout << "not ok" << endl;
+                cout << "not ok" << '\n';
             else
-                cout << q.back() << endl;
+                cout << q.back() << '\n';
 
         } else if (operation == "back_retro") {
             cin >> tm;
-            cout << q.back(tm) << endl;
+            cout << q.back(tm) << '\n';
 
         } else if (operation == "front") {
             if (q.empty())
-                cout << "not ok" << endl;
+                cout << "not ok" << '\n';
             else
-                cout << q.front() << endl;
+                cout << q.front() << '\n';
 
         } else if (operation == "front_retro") {
             cin >> tm;
-            cout << q.front(tm) << endl;
+            cout << q.front(tm) << '\n';
 
         } else if (operation == "size") {
-            cout << q.size() << endl;
+            cout << q.size() << '\n';
+
+        } else if (operation == "size_retro") {
+            cin >> tm;
+            cout << q.size(tm) << '\n';
+
+        } else if (operation == "contents" || operation == "contents_retro") {
+            tm = numeric_limits<long long>::max();
+            if (operation == "contents_retro")
+                cin >> tm;
+            bool first = true;
+            for (int element : q.contents(tm)) {
+                cout << (first ? "" : " ") << element;
+                first = false;
+            }
+            cout << '\n';
+
+        } else if (operation == "at" || operation == "at_retro") {
+            long long i;
+            cin >> i;
+            tm = numeric_limits<long long>::max();
+            if (operation == "at_retro")
+                cin >> tm;
+            const int *element = (i >= 0 ? q.try_at(i, tm) : nullptr);
+            if (element)
+                cout << *element << '\n';
+            else
+                cout << "not ok" << '\n';
+
+        } else if (operation == "transaction") {
+            // transaction n, then n of push_back_retro, push_front_retro, pop_back_retro,
+            // pop_front_retro and delete_operation with their arguments; an unknown edit rejects
+            // the transaction and ends the input being read
+            long long n;
+            cin >> n;
+            vector<retroactive_deque<int>::edit> edits;
+            string edit_operation;
+            for (long long i = 0; i < n && cin.read_operation(edit_operation); ++i) {
+                retroactive_deque<int>::edit e{retroactive_deque<int>::edit::remove, 0, 0};
+                if (edit_operation == "push_back_retro" || edit_operation == "push_front_retro") {
+                    cin >> e.x >> e.tm;
+                    e.kind = (edit_operation == "push_back_retro" ? retroactive_deque<int>::edit::push_back
+                                                                  : retroactive_deque<int>::edit::push_front);
+                } else if (edit_operation == "pop_back_retro" || edit_operation == "pop_front_retro") {
+                    cin >> e.tm;
+                    e.kind = (edit_operation == "pop_back_retro" ? retroactive_deque<int>::edit::pop_back
+                                                                 : retroactive_deque<int>::edit::pop_front);
+                } else if (edit_operation == "delete_operation")
+                    cin >> e.tm;
+                else { // its arguments are unknown, so the rest of the input can't be read in step
+                    cout << "not ok" << '\n';
+                    return;
+                }
+                edits.push_back(e);
+            }
+            bool success = q.apply_transaction(edits);
+            cout << (success ? "ok" : "not ok") << '\n';
+
+        } else if (operation == "save") {
+            string filename;
+            cin >> filename;
+            bool success = q.save_snapshot(filename);
+            cout << (success ? "ok" : "not ok") << '\n';
+
+        } else if (operation == "load") {
+            string filename;
+            cin >> filename;
+            bool success = q.load_snapshot(filename);
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "run" && allow_files) {
             string filename;
             cin >> filename;
             ifstream fin(filename);
-            run(fin);
+            Input file_in = cin.nested(fin);
+            run(file_in);
 
         } else if (operation == "clear") {
             q.clear();
 
+        } else if (operation == "stats") {
+#ifdef RETROACTIVE_STATS
+            q.stats().write(cout, "retroactive_deque");
+#else
+            cout << "not ok" << '\n'; // built without RETROACTIVE_STATS
+#endif
+
         }
     }
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    run(cin, true);
+    // --batch: text commands parsed by hand, output not flushed after each command
+    // --binary: binary operation log (see binary_reader)
+    cli_mode mode = parse_cli_mode(argc, argv);
+    if (mode != cli_mode::interactive)
+        setup_batch_output();
+
+    if (mode == cli_mode::binary) {
+        binary_reader in(cin, binary_operations);
+        run(in, true);
+    } else if (mode == cli_mode::batch) {
+        text_reader in(cin);
+        run(in, true);
+    } else {
+        stream_reader in(cin);
+        run(in, true);
+    }
 
     return 0;
 }
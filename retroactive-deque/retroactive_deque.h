@@ -1,150 +1,691 @@
 #ifndef RETROACTIVE_DEQUE_H_INCLUDED
 #define RETROACTIVE_DEQUE_H_INCLUDED
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iterator>
 #include <limits>
-#include <map>
+#include <memory>
 #include <random>
-#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../common/journal.h"
+#include "../common/retroactive_stats.h"
+#include "../common/snapshot.h"
 
 template<typename T>
 class retroactive_deque {
 
+public:
+    /// A node of the treap in a snapshot: its children (0 for none, the root is node 0), its
+    /// operation (the index of its time, element and kind) and the aggregates of its subtree
+    /// the searches for elements need.
+    struct snapshot_node {
+        uint64_t left, right, op;
+        long long balance;
+        long long side_balance[2], min_suff[2], max_suff[2]; // of the front and of the back operations
+    };
+
 private:
+    struct node_pool;
+
+    /// One node per operation, keyed by its time. Besides the balance aggregates of all the
+    /// operations, which tell whether the history is valid and the size at any time, a node
+    /// keeps the suffix aggregates of the front operations and those of the back operations
+    /// of its subtree, where the operations of the other side count as 0. Those stand for
+    /// the separate treaps of front and back operations the searches for elements need.
+    /// Nodes are persistent: a node may be shared by several versions of the deque (its refs
+    /// counts the links to it), so it is cloned before being modified unless refs == 1.
     struct treap {
+        struct side_sums {
+            long long balance, min_suff, max_suff;
+        };
+
         treap *L, *R;
-        int prior;
-        bool ins;
-        long long tm, balance, min_pref, min_suff, max_suff;
+        int prior, refs;
+        bool ins, back; // push or pop, on the back or on the front
+        long long tm, balance, min_pref;
+        side_sums sides[2]; // of the front operations (sides[0]) and of the back ones (sides[1])
+        T value; // pushed element, left default-constructed for pops
 
         treap() { }
 
-        treap(long long cur_time, bool inserted) : L(nullptr), R(nullptr),
-                prior(((rand() & 0x7FFF) << 15) | (rand() & 0x7FFF)), ins(inserted),
-                tm(cur_time), balance(ins ? 1 : -1), min_pref(balance), min_suff(balance), max_suff(balance) { }
+        treap(long long cur_time, bool inserted, bool back_op, const T& x) : L(nullptr), R(nullptr),
+                prior(((rand() & 0x7FFF) << 15) | (rand() & 0x7FFF)), refs(1), ins(inserted), back(back_op),
+                tm(cur_time), balance(ins ? 1 : -1), min_pref(balance), value(x) {
+            sides[back] = {balance, balance, balance};
+            sides[!back] = {0, 0, 0};
+        }
+
+        static inline long long weight(const treap *t) { return t->ins ? 1 : -1; }
 
-        static inline long long get_balance(treap *t) { return t ? t->balance : 0; }
+        static inline long long weight(const treap *t, bool back) { return t->back == back ? treap::weight(t) : 0; }
 
-        static inline long long get_min_pref(treap *t) { return t ? t->min_pref : 0; }
+        static inline long long get_balance(const treap *t) { return t ? t->balance : 0; }
 
-        static inline long long get_min_suff(treap *t) { return t ? t->min_suff : 0; }
+        static inline long long get_min_pref(const treap *t) { return t ? t->min_pref : 0; }
 
-        static inline long long get_max_suff(treap *t) { return t ? t->max_suff : 0; }
+        static inline long long get_balance(const treap *t, bool back) { return t ? t->sides[back].balance : 0; }
+
+        static inline long long get_min_suff(const treap *t, bool back) { return t ? t->sides[back].min_suff : 0; }
+
+        static inline long long get_max_suff(const treap *t, bool back) { return t ? t->sides[back].max_suff : 0; }
 
         static inline void recalc(treap *t) {
             if (t) {
-                t->balance = (t->ins ? 1 : -1) + treap::get_balance(t->L) + treap::get_balance(t->R);
+                t->balance = treap::weight(t) + treap::get_balance(t->L) + treap::get_balance(t->R);
                 t->min_pref = std::min(t->L ? treap::get_min_pref(t->L) : std::numeric_limits<long long>::max(),
-                              treap::get_balance(t->L) + (t->ins ? 1 : -1) + std::min(0LL, treap::get_min_pref(t->R)));
-                t->min_suff = std::min(t->R ? treap::get_min_suff(t->R) : std::numeric_limits<long long>::max(),
-                              treap::get_balance(t->R) + (t->ins ? 1 : -1) + std::min(0LL, treap::get_min_suff(t->L)));
-                t->max_suff = std::max(t->R ? treap::get_max_suff(t->R) : std::numeric_limits<long long>::min(),
-                              treap::get_balance(t->R) + (t->ins ? 1 : -1) + std::max(0LL, treap::get_max_suff(t->L)));
+                              treap::get_balance(t->L) + treap::weight(t) + std::min(0LL, treap::get_min_pref(t->R)));
+                for (int back = 0; back < 2; ++back) {
+                    long long w = treap::weight(t, back);
+                    side_sums& s = t->sides[back];
+                    s.balance = w + treap::get_balance(t->L, back) + treap::get_balance(t->R, back);
+                    s.min_suff = std::min(t->R ? treap::get_min_suff(t->R, back) : std::numeric_limits<long long>::max(),
+                                 treap::get_balance(t->R, back) + w + std::min(0LL, treap::get_min_suff(t->L, back)));
+                    s.max_suff = std::max(t->R ? treap::get_max_suff(t->R, back) : std::numeric_limits<long long>::min(),
+                                 treap::get_balance(t->R, back) + w + std::max(0LL, treap::get_max_suff(t->L, back)));
+                }
+            }
+        }
+
+        static inline treap *share(treap *t) {
+            if (t)
+                ++t->refs;
+            return t;
+        }
+
+        static void release(treap *t, node_pool& nodes) {
+            if (t && --t->refs == 0) {
+                treap::release(t->L, nodes);
+                treap::release(t->R, nodes);
+                nodes.deallocate(t);
             }
         }
 
-        static void merge(treap *& t, treap *l, treap *r) {
+        static inline treap *own(treap *t, node_pool& nodes) { // path copying
+            if (t->refs == 1)
+                return t;
+            treap *c = nodes.allocate();
+            *c = *t;
+            c->refs = 1;
+            treap::share(c->L);
+            treap::share(c->R);
+            --t->refs;
+            return c;
+        }
+
+        static void merge(treap *& t, treap *l, treap *r, node_pool& nodes) {
+            RETROACTIVE_COUNT(nodes.counters.merges);
             if (!l)
                 t = r;
             else if (!r)
                 t = l;
             else if (l->prior > r->prior) {
-                treap::merge(l->R, l->R, r);
+                l = treap::own(l, nodes);
+                treap::merge(l->R, l->R, r, nodes);
                 t = l;
             } else {
-                treap::merge(r->L, l, r->L);
+                r = treap::own(r, nodes);
+                treap::merge(r->L, l, r->L, nodes);
                 t = r;
             }
             treap::recalc(t);
         }
 
-        static void split(treap *t, treap *& l, treap *& r, long long x) { // <=x -> L,   >x -> R
+        static void split(treap *t, treap *& l, treap *& r, long long x, node_pool& nodes) { // <=x -> L,   >x -> R
+            RETROACTIVE_COUNT(nodes.counters.splits);
             if (!t) {
                 l = r = nullptr;
                 return;
             }
 
+            t = treap::own(t, nodes);
             if (t->tm <= x) {
-                treap::split(t->R, t->R, r, x);
+                treap::split(t->R, t->R, r, x, nodes);
                 l = t;
             } else {
-                treap::split(t->L, l, t->L, x);
+                treap::split(t->L, l, t->L, x, nodes);
                 r = t;
             }
             treap::recalc(l);
             treap::recalc(r);
         }
 
-        static void destroy(treap *t) {
-            if (t) {
-                treap::destroy(t->L);
-                treap::destroy(t->R);
-                delete t;
+        static void insert(treap *& t, treap *node, node_pool& nodes) {
+            treap *t1, *t2;
+            treap::split(t, t1, t2, node->tm, nodes);
+            treap::merge(t1, t1, node, nodes);
+            treap::merge(t, t1, t2, nodes);
+        }
+
+        /// Cuts the node with time tm out of the treap and hands it to the caller, who either
+        /// inserts it back or releases it.
+        static treap *extract(treap *& t, long long tm, node_pool& nodes) {
+            treap *t1, *t2, *t3;
+            treap::split(t, t1, t3, tm, nodes);
+            treap::split(t1, t1, t2, tm - 1, nodes);
+            treap::merge(t, t1, t3, nodes);
+            return t2;
+        }
+
+        static const treap *find(const treap *t, long long tm) {
+            while (t && t->tm != tm)
+                t = (tm < t->tm ? t->L : t->R);
+            return t;
+        }
+
+        /// Links nodes sorted by time into a treap in O(n): each node takes the nodes of lower
+        /// priority at the end of the right spine as its left subtree. Then the aggregates are
+        /// computed bottom-up.
+        static treap *build(const std::vector<treap*>& sorted) {
+            std::vector<treap*> spine;
+            for (treap *t : sorted) {
+                treap *last = nullptr;
+                while (!spine.empty() && spine.back()->prior < t->prior) {
+                    last = spine.back();
+                    spine.pop_back();
+                }
+                t->L = last;
+                if (!spine.empty())
+                    spine.back()->R = t;
+                spine.push_back(t);
             }
+            if (spine.empty())
+                return nullptr;
+            treap::recalc_all(spine.front());
+            return spine.front();
         }
 
-        static void copy(treap *dest, treap *src) {
-            *dest = *src;
-            if (src->L) {
-                dest->L = new treap();
-                treap::copy(dest->L, src->L);
+        static void recalc_all(treap *t) {
+            if (t) {
+                treap::recalc_all(t->L);
+                treap::recalc_all(t->R);
+                treap::recalc(t);
             }
-            if (src->R) {
-                dest->R = new treap();
-                treap::copy(dest->R, src->R);
+        }
+
+        /// Appends the image of t to image in pre-order, ops being the number of operations
+        /// before t, and returns the index of its root.
+        static uint64_t save(const treap *t, std::vector<snapshot_node>& image, uint64_t& ops) {
+            uint64_t i = image.size();
+            image.push_back(snapshot_node());
+            uint64_t left = (t->L ? treap::save(t->L, image, ops) : 0), op = ops++;
+            uint64_t right = (t->R ? treap::save(t->R, image, ops) : 0);
+            snapshot_node& n = image[i];
+            n.left = left;
+            n.right = right;
+            n.op = op;
+            n.balance = t->balance;
+            for (int back = 0; back < 2; ++back) {
+                n.side_balance[back] = t->sides[back].balance;
+                n.min_suff[back] = t->sides[back].min_suff;
+                n.max_suff[back] = t->sides[back].max_suff;
             }
+            return i;
         }
 
-        static void insert(treap *& t, long long tm, bool ins) {
-            treap *t1, *t2;
-            treap::split(t, t1, t2, tm);
-            treap::merge(t1, t1, new treap(tm, ins));
-            treap::merge(t, t1, t2);
+        static void fill_vector(const treap *t, std::vector<const treap*>& v) { // necessary for comparisons
+            if (t) {
+                treap::fill_vector(t->L, v);
+                v.push_back(t);
+                treap::fill_vector(t->R, v);
+            }
         }
 
-        static void erase(treap *& t, long long tm) {
-            treap *t1, *t2, *t3;
-            treap::split(t, t1, t3, tm);
-            treap::split(t1, t1, t2, tm - 1);
-            if (t2)
-                delete t2;
-            treap::merge(t, t1, t3);
+        static bool equal(const treap *x, const treap *y) {
+            std::vector<const treap*> vx, vy;
+            treap::fill_vector(x, vx);
+            treap::fill_vector(y, vy);
+            if (vx.size() != vy.size())
+                return false;
+            for (size_t i = 0; i < vx.size(); ++i)
+                if (vx[i]->tm != vy[i]->tm || vx[i]->ins != vy[i]->ins || vx[i]->back != vy[i]->back ||
+                        !(vx[i]->value == vy[i]->value))
+                    return false;
+            return true;
         }
 
-        static long long get_kth(treap *t, long long k) { // 1-indexing
+        /// The searches below find the latest operation of one side whose suffix balance among
+        /// the operations of that side is k. An operation of the other side never matches: the
+        /// suffix balance it ties with is that of a later operation, which is found first.
+        static const treap *get_kth(const treap *t, long long k, bool back) { // 1-indexing
             while (t) {
                 if (t->R) {
-                    if (k >= treap::get_min_suff(t->R) && k <= treap::get_max_suff(t->R)) {
+                    if (k >= treap::get_min_suff(t->R, back) && k <= treap::get_max_suff(t->R, back)) {
                         t = t->R;
                         continue;
                     }
                 }
-                long long right_balance = treap::get_balance(t->R) + (t->ins ? 1 : -1);
+                long long right_balance = treap::get_balance(t->R, back) + treap::weight(t, back);
                 if (right_balance == k)
-                    return t->tm;
+                    return t;
                 k -= right_balance;
                 t = t->L;
             }
-            return std::numeric_limits<long long>::max(); // epic fail
+            return nullptr; // epic fail
+        }
+
+        /// Read-only counterparts of split + query + merge: they look only at the
+        /// operations with time <= x and never modify the treap.
+        static long long get_prefix_balance(const treap *t, long long x) {
+            long long balance = 0;
+            while (t) {
+                if (t->tm <= x) {
+                    balance += treap::get_balance(t->L) + treap::weight(t);
+                    t = t->R;
+                } else
+                    t = t->L;
+            }
+            return balance;
+        }
+
+#ifdef RETROACTIVE_STATS
+        static void measure(const treap *t, size_t depth, retroactive_stats& s) {
+            if (t) {
+                s.add_node(depth);
+                treap::measure(t->L, depth + 1, s);
+                treap::measure(t->R, depth + 1, s);
+            }
+        }
+#endif
+
+        static const treap *get_prefix_kth(const treap *t, long long x, long long k, bool back, long long& balance) {
+            // balance receives the balance of the visited operations of that side with time <= x
+            balance = 0;
+            if (!t)
+                return nullptr;
+            if (t->tm > x)
+                return treap::get_prefix_kth(t->L, x, k, back, balance);
+
+            const treap *ans = treap::get_prefix_kth(t->R, x, k, back, balance);
+            if (ans)
+                return ans;
+            balance += treap::weight(t, back);
+            if (balance == k)
+                return t;
+            if (t->L && k - balance >= treap::get_min_suff(t->L, back) && k - balance <= treap::get_max_suff(t->L, back))
+                return treap::get_kth(t->L, k - balance, back);
+            balance += treap::get_balance(t->L, back);
+            return nullptr;
+        }
+
+        static inline const treap *get_prefix_kth(const treap *t, long long x, long long k, bool back) { // 1-indexing
+            long long balance;
+            return treap::get_prefix_kth(t, x, k, back, balance);
+        }
+    };
+
+    /// Slab allocator for treap nodes: nodes are carved from fixed-size blocks and
+    /// released nodes are chained into a free list (through L) for reuse. clear()
+    /// forgets every node at once and keeps the blocks for the next nodes.
+    /// The pool is shared by all the copies of a deque, since they share nodes.
+    struct node_pool {
+        static const size_t block_size = 1024;
+
+        std::vector<std::unique_ptr<treap[]>> blocks;
+        size_t next_block;
+        treap *cursor, *cursor_end;
+        treap *free_list;
+#ifdef RETROACTIVE_STATS
+        retroactive_counters counters;
+#endif
+
+        node_pool() : blocks(), next_block(0), cursor(nullptr), cursor_end(nullptr), free_list(nullptr) { }
+
+        node_pool(const node_pool&) = delete;
+        node_pool& operator=(const node_pool&) = delete;
+
+        treap *allocate() {
+            if (free_list) {
+                treap *t = free_list;
+                free_list = t->L;
+                return t;
+            }
+            if (cursor == cursor_end) {
+                if (next_block == blocks.size())
+                    blocks.emplace_back(new treap[block_size]);
+                cursor = blocks[next_block++].get();
+                cursor_end = cursor + block_size;
+            }
+            return cursor++;
+        }
+
+        inline treap *create(long long tm, bool ins, bool back, const T& x) {
+            treap *t = allocate();
+            *t = treap(tm, ins, back, x);
+            return t;
+        }
+
+        inline void deallocate(treap *t) {
+            t->L = free_list;
+            free_list = t;
+        }
+
+        void clear() {
+            next_block = 0;
+            cursor = cursor_end = nullptr;
+            free_list = nullptr;
+        }
+    };
+
+    /// Cursors over the "records" of one side of the treap restricted to the operations with
+    /// time <= x: the operations of that side whose suffix balance k (among the operations of
+    /// the side) is greater than that of all the later ones, i.e. the ones get_prefix_kth
+    /// finds. Both of them first cut the restricted treap into O(log n) pieces (whole subtrees
+    /// and single nodes) along the search path of x, then walk the pieces skipping every
+    /// subtree that can't hold a wanted record. Listing k records thus visits only the nodes on
+    /// their paths, O(k + log n) for a history without long runs of operations between the
+    /// records.
+    struct record_cursor {
+        struct frame {
+            const treap *t;
+            bool whole; // the subtree of t or only the node t itself
+            long long balance, max_suff; // of the operations after it (descending_records only)
+        };
+
+        std::vector<frame> stack;
+        const treap *current; // the last found record or nullptr
+        long long current_k;
+        bool back;
+
+        record_cursor(bool back) : stack(), current(nullptr), current_k(0), back(back) { }
+
+        inline long long side_weight(const treap *t) const {
+            return treap::weight(t, back);
+        }
+
+        inline long long side_balance(const treap *t) const {
+            return treap::get_balance(t, back);
+        }
+
+        inline long long side_max_suff(const treap *t) const {
+            return treap::get_max_suff(t, back);
+        }
+
+        static void cut(const treap *t, long long x, std::vector<frame>& pieces) { // in time order
+            while (t) {
+                if (t->tm <= x) {
+                    if (t->L)
+                        pieces.push_back({t->L, true, 0, 0});
+                    pieces.push_back({t, false, 0, 0});
+                    t = t->R;
+                } else
+                    t = t->L;
+            }
         }
     };
 
-    std::map<long long, T> operations;
-    std::set<long long> pop_operations;
-    treap *ul, *ur;
-    treap *balance_tree;
+    /// Records with k = k0, k0 + 1, ... going back in time from x.
+    struct ascending_records : record_cursor {
+        long long balance; // of the visited operations
+
+        ascending_records() : record_cursor(false), balance(0) { }
+
+        ascending_records(const treap *t, long long x, long long k0, bool back) : record_cursor(back), balance(0) {
+            record_cursor::cut(t, x, this->stack); // the latest piece ends up on the top
+            this->current_k = k0 - 1; // the searched balance is always current_k + 1
+            next();
+        }
+
+        void next() {
+            while (!this->stack.empty()) {
+                typename record_cursor::frame f = this->stack.back();
+                this->stack.pop_back();
+                if (f.whole) {
+                    if (balance + this->side_max_suff(f.t) <= this->current_k) { // the balance doesn't get that high
+                        balance += this->side_balance(f.t);
+                        continue;
+                    }
+                    if (f.t->L)
+                        this->stack.push_back({f.t->L, true, 0, 0});
+                    this->stack.push_back({f.t, false, 0, 0});
+                    if (f.t->R)
+                        this->stack.push_back({f.t->R, true, 0, 0});
+                } else {
+                    balance += this->side_weight(f.t);
+                    if (balance > this->current_k) {
+                        this->current = f.t;
+                        this->current_k = balance;
+                        return;
+                    }
+                }
+            }
+            this->current = nullptr;
+        }
+    };
+
+    /// Records with k = k0, k0 - 1, ..., 1 going forward in time up to x. If there is no
+    /// record with k = k0, the first one is the record with the greatest k < k0. Every frame
+    /// carries the balance and the greatest suffix balance of the operations after it, so a
+    /// subtree holds a record iff its own greatest suffix balance beats that of the rest.
+    struct descending_records : record_cursor {
+        long long limit; // the greatest k still wanted
+
+        descending_records() : record_cursor(true), limit(0) { }
+
+        descending_records(const treap *t, long long x, long long k0, bool back) : record_cursor(back), limit(k0) {
+            std::vector<typename record_cursor::frame> pieces;
+            record_cursor::cut(t, x, pieces);
+            long long balance = 0, max_suff = 0; // the empty suffix counts, no record is below 1
+            for (size_t i = pieces.size(); i-- > 0; ) {
+                typename record_cursor::frame f = pieces[i];
+                f.balance = balance;
+                f.max_suff = max_suff;
+                this->stack.push_back(f); // the earliest piece ends up on the top
+                long long piece_balance = (f.whole ? this->side_balance(f.t) : this->side_weight(f.t));
+                long long piece_max_suff = (f.whole ? this->side_max_suff(f.t) : this->side_weight(f.t));
+                max_suff = std::max(max_suff, balance + piece_max_suff);
+                balance += piece_balance;
+            }
+            next();
+        }
 
-    inline long long get_last_time() {
-        if (operations.empty() && pop_operations.empty())
+        void next() {
+            while (!this->stack.empty()) {
+                typename record_cursor::frame f = this->stack.back();
+                this->stack.pop_back();
+                if (f.whole) {
+                    if (f.balance + this->side_max_suff(f.t) <= f.max_suff || f.max_suff >= limit)
+                        continue;
+                    const treap *r = f.t->R;
+                    long long balance = f.balance + this->side_balance(r); // after the node
+                    long long max_suff = (r ? std::max(f.max_suff, f.balance + this->side_max_suff(r)) : f.max_suff);
+                    if (r)
+                        this->stack.push_back({r, true, f.balance, f.max_suff});
+                    this->stack.push_back({f.t, false, balance, max_suff});
+                    if (f.t->L) {
+                        long long node_balance = balance + this->side_weight(f.t);
+                        this->stack.push_back({f.t->L, true, node_balance, std::max(max_suff, node_balance)});
+                    }
+                } else {
+                    long long k = f.balance + this->side_weight(f.t);
+                    if (k > f.max_suff && k <= limit) {
+                        this->current = f.t;
+                        this->current_k = k;
+                        limit = k - 1;
+                        return;
+                    }
+                }
+            }
+            this->current = nullptr;
+        }
+    };
+
+    /// In-order cursor over the operations with time > x, O(log n) to place and O(1)
+    /// amortized per step.
+    struct operation_cursor {
+        std::vector<const treap*> stack; // the next operation on the top
+
+        void seek(const treap *t, long long x) {
+            stack.clear();
+            while (t) {
+                if (t->tm > x) {
+                    stack.push_back(t);
+                    t = t->L;
+                } else
+                    t = t->R;
+            }
+        }
+
+        inline const treap *peek() const {
+            return stack.empty() ? nullptr : stack.back();
+        }
+
+        void next() {
+            const treap *t = stack.back()->R;
+            stack.pop_back();
+            for (; t; t = t->L)
+                stack.push_back(t);
+        }
+    };
+
+    std::shared_ptr<node_pool> nodes;
+    treap *tree; // also serves as the log of all the operations
+
+    /// Copy of the contents at the present, patched by the updates that come after all the
+    /// other operations, so that the reads at the present are O(1). A retroactive update makes
+    /// it stale, and it is rebuilt from the treap once as many updates at the present as there
+    /// are elements have followed, so the rebuild is O(1) amortized per update. Only updates
+    /// touch it, so reads stay safe to run concurrently.
+    std::deque<T> present;
+    bool present_valid;
+    size_t present_lag; // updates at the present since it went stale
+    retroactive_journal<T> *journal; // nullptr if none is attached
+
+    inline void log_update(journal_op op, const T& x, long long tm) {
+        if (journal) {
+            journal_record<T> update = {op, x, tm};
+            journal->record(&update, 1);
+        }
+    }
+
+    inline long long get_last_time() const {
+        const treap *t = tree;
+        if (!t)
             return 0;
-        return std::max(operations.empty() ? std::numeric_limits<long long>::min() : operations.rbegin()->first,
-                        pop_operations.empty() ? std::numeric_limits<long long>::min() : *pop_operations.rbegin()) + 1;
+        while (t->R)
+            t = t->R;
+        return t->tm + 1;
+    }
+
+    inline bool at_present(long long tm) const { // no operation after tm
+        return !tree || tm >= get_last_time();
+    }
+
+    /// Called after every successful update: returns whether present has to be patched with
+    /// it, i.e. whether present is valid and the update came at the present. Otherwise present
+    /// goes stale or, if it already is, the update counts towards its rebuild.
+    bool patch_present(bool patchable) {
+        if (patchable && present_valid)
+            return true;
+        if (!patchable) {
+            present_valid = false;
+            present.clear();
+        } else if (++present_lag >= size()) { // the update is already in the treap
+            contents_range r = contents();
+            present.assign(r.begin(), r.end());
+            present_valid = true;
+        } else
+            return false;
+        present_lag = 0;
+        return false;
     }
 
     inline bool check_valid() {
-        return treap::get_min_pref(balance_tree) >= 0;
+        return treap::get_min_pref(tree) >= 0;
+    }
+
+    inline const T *get_value(const treap *l, const treap *r) const { // the later of two push operations
+        const treap *t = (!l || (r && r->tm > l->tm)) ? r : l;
+        return t && t->ins ? &t->value : nullptr; // the deque is empty at that time
+    }
+
+    /// The i-th element (0-indexing) of the deque of size cur_size at time tm, see back().
+    inline const T *get_element(long long i, long long cur_size, long long tm) const {
+        if (i < 0 || i >= cur_size) // the searches would find elements popped by then
+            return nullptr;
+        return get_value(treap::get_prefix_kth(tree, tm, i + 1, false), treap::get_prefix_kth(tree, tm, cur_size - i, true));
+    }
+
+    /// try_back (back = true) or try_front for every time of times. Between two query times
+    /// the operations are replayed one by one on the size and the end element, which only a
+    /// pop on that end makes unknown; it is then searched for again if a query needs it. A
+    /// query farther than a few operations from the previous one is answered from scratch.
+    std::vector<const T*> get_ends(const std::vector<long long>& times, bool back) const {
+        const size_t max_steps = 32;
+        std::vector<const T*> ends(times.size(), nullptr);
+        operation_cursor ops;
+        long long cur_size = 0, prev_tm = 0;
+        const T *end = nullptr;
+        bool known = false, placed = false;
+        for (size_t i = 0; i < times.size(); ++i) {
+            long long tm = times[i];
+            size_t steps = 0;
+            if (placed && tm >= prev_tm) {
+                for (const treap *op; (op = ops.peek()) && op->tm <= tm && steps < max_steps; ops.next(), ++steps) {
+                    cur_size += treap::weight(op);
+                    if (op->ins && (op->back == back || cur_size == 1)) {
+                        end = &op->value;
+                        known = true;
+                    } else if (!op->ins)
+                        known = known && op->back != back && cur_size > 0;
+                }
+            }
+            if (!placed || tm < prev_tm || (ops.peek() && ops.peek()->tm <= tm)) { // unsorted or too far
+                ops.seek(tree, tm);
+                cur_size = size(tm);
+                known = false;
+                placed = true;
+            }
+            if (!known) {
+                end = get_element(back ? cur_size - 1 : 0, cur_size, tm);
+                known = true;
+            }
+            ends[i] = (cur_size > 0 ? end : nullptr);
+            prev_tm = tm;
+        }
+        return ends;
+    }
+
+    static const T& default_value() {
+        static const T value = T();
+        return value;
+    }
+
+    inline node_pool& pool() {
+        if (!nodes) // the deque has been moved from
+            nodes = std::make_shared<node_pool>();
+        return *nodes;
+    }
+
+    void release_trees() {
+        if (nodes.use_count() > 1) // some nodes may be shared with other versions
+            treap::release(tree, *nodes);
+        tree = nullptr;
     }
 
 public:
+    typedef T value_type;
+
+    /// One edit of apply_transaction(): a push (with the element x) or a pop at time tm, or
+    /// the deletion of the operation at time tm.
+    struct edit {
+        enum kind_t { push_back, push_front, pop_back, pop_front, remove };
+
+        kind_t kind;
+        T x;
+        long long tm;
+    };
+
+    /// Sections of the snapshots, see save_snapshot().
+    enum snapshot_section {
+        section_times, section_values, section_kinds, section_nodes
+    };
+
     /*** Friend operators ***/
     template<class T1>
         friend bool operator==(const retroactive_deque<T1>& x, const retroactive_deque<T1>& y);
@@ -153,56 +694,83 @@ public:
 
 
     /*** Constructors and destructor ***/
-    retroactive_deque<T>() : ul(nullptr), ur(nullptr), balance_tree(nullptr) { }
+    retroactive_deque<T>() : nodes(std::make_shared<node_pool>()), tree(nullptr), present(), present_valid(true),
+            present_lag(0), journal(nullptr) { }
+
+    /// O(1): the copy shares all the nodes and each later update of either version clones only
+    /// the O(log n) nodes on its paths. Versions sharing nodes mustn't be updated concurrently.
+    /// The copy of the present contents isn't copied along, so the new version starts with it stale.
+    retroactive_deque<T>(const retroactive_deque<T>& other) : nodes(other.nodes), tree(treap::share(other.tree)),
+            present(), present_valid(!tree), present_lag(0), journal(nullptr) { }
 
-    retroactive_deque<T>(const retroactive_deque<T>& other) {
-        operations = other.operations;
-        pop_operations = other.pop_operations;
-        ul = new treap();
-        treap::copy(ul, other.ul);
-        ur = new treap();
-        treap::copy(ur, other.ur);
-        balance_tree = new treap();
-        treap::copy(balance_tree, other.balance_tree);
+    retroactive_deque<T>(retroactive_deque<T>&& other) noexcept : nodes(std::move(other.nodes)), tree(other.tree),
+            present(std::move(other.present)), present_valid(other.present_valid), present_lag(other.present_lag),
+            journal(nullptr) {
+        other.tree = nullptr;
+        other.present.clear();
+        other.present_valid = true;
+        other.present_lag = 0;
     }
 
     ~retroactive_deque<T>() {
-        treap::destroy(ul);
-        treap::destroy(ur);
-        treap::destroy(balance_tree);
+        release_trees();
     }
 
 
     /*** Operators ***/
     retroactive_deque<T>& operator=(const retroactive_deque<T>& other) {
-        operations = other.operations;
-        pop_operations = other.pop_operations;
-        treap::destroy(ul);
-        treap::destroy(ur);
-        treap::destroy(balance_tree);
-        ul = new treap();
-        treap::copy(ul, other.ul);
-        ur = new treap();
-        treap::copy(ur, other.ur);
-        balance_tree = new treap();
-        treap::copy(balance_tree, other.balance_tree);
+        if (this == &other)
+            return *this;
+        treap *other_tree = treap::share(other.tree);
+        release_trees();
+        nodes = other.nodes;
+        tree = other_tree;
+        present.clear();
+        present_valid = !tree;
+        present_lag = 0;
+        return *this;
+    }
+
+    retroactive_deque<T>& operator=(retroactive_deque<T>&& other) noexcept {
+        if (this == &other)
+            return *this;
+        release_trees();
+        nodes = std::move(other.nodes);
+        tree = other.tree;
+        present = std::move(other.present);
+        present_valid = other.present_valid;
+        present_lag = other.present_lag;
+        other.tree = nullptr;
+        other.present.clear();
+        other.present_valid = true;
+        other.present_lag = 0;
         return *this;
     }
 
+    void swap(retroactive_deque<T>& other) noexcept {
+        std::swap(nodes, other.nodes);
+        std::swap(tree, other.tree);
+        present.swap(other.present);
+        std::swap(present_valid, other.present_valid);
+        std::swap(present_lag, other.present_lag);
+    }
+
 
     /*** Retroactive queries ***/
     bool insert_push_operation(const T& x, long long tm, bool back_op) {
-        if (operations.find(tm) != operations.end() || pop_operations.find(tm) != pop_operations.end())
+        RETROACTIVE_COUNT(pool().counters.updates);
+        if (treap::find(tree, tm))
             return false;
 
-        treap::insert(balance_tree, tm, true);
-        if (!check_valid()) {
-            treap::erase(balance_tree, tm);
-            return false;
+        bool latest = at_present(tm);
+        treap::insert(tree, pool().create(tm, true, back_op, x), pool()); // a push keeps the history valid
+        if (patch_present(latest)) {
+            if (back_op)
+                present.push_back(x);
+            else
+                present.push_front(x);
         }
-
-        operations[tm] = x;
-        treap::insert(back_op ? ur : ul, tm, true);
+        log_update(back_op ? journal_op::push_back : journal_op::push_front, x, tm);
         return true;
     }
 
@@ -215,17 +783,24 @@ public:
     }
 
     bool insert_pop_operation(long long tm, bool back_op) {
-        if (operations.find(tm) != operations.end() || pop_operations.find(tm) != pop_operations.end())
+        RETROACTIVE_COUNT(pool().counters.updates);
+        if (treap::find(tree, tm))
             return false;
 
-        treap::insert(balance_tree, tm, false);
+        bool latest = at_present(tm);
+        treap::insert(tree, pool().create(tm, false, back_op, T()), pool());
         if (!check_valid()) {
-            treap::erase(balance_tree, tm);
+            RETROACTIVE_COUNT(pool().counters.rollbacks);
+            treap::release(treap::extract(tree, tm, pool()), pool());
             return false;
         }
-
-        pop_operations.insert(tm);
-        treap::insert(back_op ? ur : ul, tm, false);
+        if (patch_present(latest)) {
+            if (back_op)
+                present.pop_back();
+            else
+                present.pop_front();
+        }
+        log_update(back_op ? journal_op::pop_back : journal_op::pop_front, T(), tm);
         return true;
     }
 
@@ -238,74 +813,261 @@ public:
     }
 
     bool delete_operation(long long tm) {
-        auto op_it = operations.find(tm);
-        if (op_it != operations.end()) { // it was push operation
-            treap::erase(balance_tree, tm);
-            if (!check_valid()) {
-                treap::insert(balance_tree, tm, true);
-                return false;
-            }
+        RETROACTIVE_COUNT(pool().counters.updates);
+        if (!treap::find(tree, tm)) // there wasn't any operation with that time
+            return false;
 
-            treap::erase(ul, tm);
-            treap::erase(ur, tm);
-            operations.erase(op_it);
-            return true;
+        bool latest = (tm == get_last_time() - 1);
+        treap *op = treap::extract(tree, tm, pool());
+        if (!check_valid()) { // the node goes back as it is, without copying the element
+            RETROACTIVE_COUNT(pool().counters.rollbacks);
+            treap::insert(tree, op, pool());
+            return false;
+        }
+        // Undoing the latest push drops its element; undoing a pop would need the popped one.
+        if (patch_present(latest && op->ins)) {
+            if (op->back)
+                present.pop_back();
+            else
+                present.pop_front();
         }
+        treap::release(op, pool());
+        log_update(journal_op::remove, T(), tm);
+        return true;
+    }
 
-        auto pop_op_it = pop_operations.find(tm);
-        if (pop_op_it != pop_operations.end()) { // it was pop operation
-            treap::erase(balance_tree, tm);
-            if (!check_valid()) {
-                treap::insert(balance_tree, tm, false);
-                return false;
+    /// Applies all the edits or none of them. The history has to be valid only once all of them
+    /// are applied, e.g. a push and an earlier pop of its element may come in any order, and it
+    /// is checked once at the end. The rollback is O(1): the edits go to a new version of the
+    /// treap, which replaces the old one only if it is valid. The journal gets the edits as
+    /// one update.
+    bool apply_transaction(const std::vector<edit>& edits) {
+        treap *snapshot = treap::share(tree);
+        bool valid = true;
+        for (size_t i = 0; i < edits.size() && valid; ++i) {
+            const edit& e = edits[i];
+            RETROACTIVE_COUNT(pool().counters.updates);
+            bool exists = (treap::find(tree, e.tm) != nullptr);
+            if (e.kind == edit::remove) {
+                valid = exists;
+                if (valid)
+                    treap::release(treap::extract(tree, e.tm, pool()), pool());
+            } else {
+                valid = !exists;
+                bool push = (e.kind == edit::push_back || e.kind == edit::push_front);
+                bool back_op = (e.kind == edit::push_back || e.kind == edit::pop_back);
+                if (valid)
+                    treap::insert(tree, pool().create(e.tm, push, back_op, push ? e.x : T()), pool());
             }
-
-            treap::erase(ul, tm);
-            treap::erase(ur, tm);
-            pop_operations.erase(pop_op_it);
-            return true;
         }
 
-        return false; // there wasn't any operation with that time
+        if (!valid || !check_valid()) {
+            RETROACTIVE_COUNT(pool().counters.rollbacks);
+            treap::release(tree, pool());
+            tree = snapshot;
+            return false;
+        }
+        treap::release(snapshot, pool()); // frees the nodes the edits have replaced
+        if (!edits.empty())
+            patch_present(false);
+        if (journal && !edits.empty()) {
+            static const journal_op ops[] = {journal_op::push_back, journal_op::push_front, journal_op::pop_back,
+                                             journal_op::pop_front, journal_op::remove};
+            std::vector<journal_record<T>> update;
+            update.reserve(edits.size());
+            for (const edit& e : edits)
+                update.push_back({ops[e.kind], e.kind == edit::push_back || e.kind == edit::push_front ? e.x : T(), e.tm});
+            journal->record(update.data(), update.size());
+        }
+        return true;
     }
 
     /// Time for the most difficult part!
-    T back(long long tm = std::numeric_limits<long long>::max()) {
-        T ans;
+    /// Let push_front write to the cell left of the first one and push_back to the cell right of
+    /// the last one, while pops only move the ends. Then each cell of the deque holds the value of
+    /// the latest push that wrote to it. The cell of the i-th element (0-indexing) was last written
+    /// either by the latest push_front whose suffix balance among the front operations is i + 1,
+    /// or by the latest push_back whose suffix balance among the back operations is size - i,
+    /// whichever happened later.
+    /// Queries don't modify the tree, so any number of readers may run them concurrently.
+    /// They point to the element inside the node of its push (or inside the copy of the present
+    /// contents, which answers the reads at the default tm in O(1) unless it is stale), which
+    /// stays valid until the next update or clear() of this deque, and return nullptr if it is
+    /// empty at time tm.
+    const T *try_back(long long tm = std::numeric_limits<long long>::max()) const {
+        if (tm == std::numeric_limits<long long>::max() && present_valid)
+            return present.empty() ? nullptr : &present.back();
+        long long cur_size = size(tm);
+        return get_element(cur_size - 1, cur_size, tm);
+    }
 
-        treap *ul1, *ul2;
-        treap *ur1, *ur2;
-        treap::split(ul, ul1, ul2, tm);
-        treap::split(ur, ur1, ur2, tm);
-        if (treap::get_max_suff(ur1) > std::max(0LL, -treap::get_min_pref(ul1)))
-            ans = operations[treap::get_kth(ur1, 1)];
-        else {
-            long long index = treap::get_balance(ul1) + treap::get_balance(ur1);
-            ans = operations[treap::get_kth(ul1, index)];
-        }
-        treap::merge(ul, ul1, ul2);
-        treap::merge(ur, ur1, ur2);
+    const T *try_front(long long tm = std::numeric_limits<long long>::max()) const {
+        if (tm == std::numeric_limits<long long>::max() && present_valid)
+            return present.empty() ? nullptr : &present.front();
+        return get_element(0, size(tm), tm);
+    }
+
+    /// Random access in O(log n): the i-th element from the front (0-indexing) at time tm, or
+    /// nullptr if i is out of range.
+    const T *try_at(size_t i, long long tm = std::numeric_limits<long long>::max()) const {
+        if (tm == std::numeric_limits<long long>::max() && present_valid)
+            return i < present.size() ? &present[i] : nullptr;
+        long long cur_size = size(tm);
+        return i < static_cast<size_t>(cur_size) ? get_element(static_cast<long long>(i), cur_size, tm) : nullptr;
+    }
+
+    /// The same, but a default-constructed T for an empty deque.
+    const T& back(long long tm = std::numeric_limits<long long>::max()) const {
+        const T *x = try_back(tm);
+        return x ? *x : default_value();
+    }
+
+    const T& front(long long tm = std::numeric_limits<long long>::max()) const {
+        const T *x = try_front(tm);
+        return x ? *x : default_value();
+    }
+
+    const T& at(size_t i, long long tm = std::numeric_limits<long long>::max()) const {
+        const T *x = try_at(i, tm);
+        return x ? *x : default_value();
+    }
+
+    /// try_back and try_front at each of the given times, in one sweep over the operations
+    /// between them when the times are sorted (unsorted times are answered too, only slower).
+    /// Times between the same two operations cost O(1) and the others at most O(log n).
+    std::vector<const T*> try_back_at(const std::vector<long long>& times) const {
+        return get_ends(times, true);
+    }
+
+    std::vector<const T*> try_front_at(const std::vector<long long>& times) const {
+        return get_ends(times, false);
+    }
 
-        return ans;
+    std::vector<T> back_at(const std::vector<long long>& times) const {
+        std::vector<T> values;
+        values.reserve(times.size());
+        for (const T *x : get_ends(times, true))
+            values.push_back(x ? *x : default_value());
+        return values;
     }
 
-    T front(long long tm = std::numeric_limits<long long>::max()) {
-        T ans;
+    std::vector<T> front_at(const std::vector<long long>& times) const {
+        std::vector<T> values;
+        values.reserve(times.size());
+        for (const T *x : get_ends(times, false))
+            values.push_back(x ? *x : default_value());
+        return values;
+    }
+
+    /// Number of elements at time tm: the balance of the operations up to it.
+    inline size_t size(long long tm) const {
+        return treap::get_prefix_balance(tree, tm);
+    }
+
+    /// Input iterator over the deque at some time, from the front to the back. The i-th element
+    /// is the later of the front record with k = i + 1 and the back record with k = size - i.
+    /// The former get earlier and the latter later as i grows, so the front of the deque comes
+    /// from front records and the rest from back records, and each side is walked only once.
+    class contents_iterator {
+        friend class retroactive_deque<T>;
+
+        ascending_records left;
+        descending_records right;
+        long long index, cur_size;
+        bool right_only; // the rest of the elements come from back records
+        const T *value;
+
+        contents_iterator(const retroactive_deque<T>& q, long long tm, size_t offset) : left(), right(), index(0),
+                cur_size(static_cast<long long>(q.size(tm))), right_only(false), value(nullptr) {
+            index = std::min(static_cast<long long>(offset), cur_size);
+            if (index < cur_size) {
+                left = ascending_records(q.tree, tm, index + 1, false);
+                right = descending_records(q.tree, tm, cur_size - index, true);
+            }
+            settle();
+        }
+
+        explicit contents_iterator(long long cur_size) : left(), right(), index(cur_size), cur_size(cur_size),
+                right_only(true), value(nullptr) { }
+
+        inline const treap *right_record() const {
+            return right.current && right.current_k == cur_size - index ? right.current : nullptr;
+        }
+
+        void settle() {
+            if (index == cur_size) {
+                value = nullptr;
+                return;
+            }
+            const treap *l = (right_only ? nullptr : left.current), *r = right_record();
+            if (!l || (r && r->tm > l->tm)) {
+                right_only = true;
+                value = &r->value;
+            } else
+                value = &l->value;
+        }
+
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const T* pointer;
+        typedef const T& reference;
+
+        inline const T& operator*() const {
+            return *value;
+        }
+
+        inline const T *operator->() const {
+            return value;
+        }
+
+        contents_iterator& operator++() {
+            if (!right_only)
+                left.next();
+            if (right_record())
+                right.next();
+            ++index;
+            settle();
+            return *this;
+        }
+
+        inline bool operator==(const contents_iterator& other) const {
+            return index == other.index;
+        }
+
+        inline bool operator!=(const contents_iterator& other) const {
+            return index != other.index;
+        }
+    };
+
+    class contents_range {
+        friend class retroactive_deque<T>;
+
+        contents_iterator first, last;
+
+        contents_range(const contents_iterator& first, const contents_iterator& last) : first(first), last(last) { }
+
+    public:
+        inline contents_iterator begin() const {
+            return first;
+        }
 
-        treap *ul1, *ul2;
-        treap *ur1, *ur2;
-        treap::split(ul, ul1, ul2, tm);
-        treap::split(ur, ur1, ur2, tm);
-        if (treap::get_max_suff(ul1) > std::max(0LL, -treap::get_min_pref(ur1)))
-            ans = operations[treap::get_kth(ul1, 1)];
-        else {
-            long long index = treap::get_balance(ur1) + treap::get_balance(ul1);
-            ans = operations[treap::get_kth(ur1, index)];
+        inline contents_iterator end() const {
+            return last;
         }
-        treap::merge(ul, ul1, ul2);
-        treap::merge(ur, ur1, ur2);
 
-        return ans;
+        inline size_t size() const {
+            return last.index - first.index;
+        }
+    };
+
+    /// The elements at time tm from the offset-th one (0-indexing) to the back, listed in
+    /// O(k + log n) without copying or modifying anything. Like the references returned by
+    /// back(), the range is valid until the next update or clear() of this deque.
+    contents_range contents(long long tm = std::numeric_limits<long long>::max(), size_t offset = 0) const {
+        contents_iterator first(*this, tm, offset);
+        return contents_range(first, contents_iterator(first.cur_size));
     }
 
 
@@ -335,30 +1097,158 @@ public:
     }
 
     void clear() {
-        operations.clear();
-        pop_operations.clear();
-        treap::destroy(ul);
-        ul = nullptr;
-        treap::destroy(ur);
-        ur = nullptr;
-        treap::destroy(balance_tree);
-        balance_tree = nullptr;
+        release_trees();
+        present.clear();
+        present_valid = true;
+        present_lag = 0;
+        if (nodes.use_count() == 1)
+            nodes->clear(); // releases every node at once instead of walking the trees
+        log_update(journal_op::clear, T(), 0);
     }
 
-    inline size_t size() {
-        return treap::get_balance(balance_tree);
+    inline size_t size() const {
+        return treap::get_balance(tree);
     }
 
-    inline bool empty() {
+    inline bool empty() const {
         return size() == 0;
     }
+
+
+    /*** Journal ***/
+    /// Hands every accepted update to journal from now on (see journal.h), nullptr detaches
+    /// it; the present-time updates are recorded with their times. The journal stays with this
+    /// version: it isn't shared by the copies, moved or swapped, and assignments, swaps and
+    /// load_snapshot() aren't recorded.
+    void attach_journal(retroactive_journal<T> *j) {
+        journal = j;
+    }
+
+    /// Applies the records of an update again, several of them as a transaction; false if
+    /// one of them is rejected.
+    bool replay(const std::vector<journal_record<T>>& update) {
+        if (update.size() > 1) {
+            std::vector<edit> edits;
+            edits.reserve(update.size());
+            for (const journal_record<T>& r : update) {
+                typename edit::kind_t kind = (r.op == journal_op::push_back ? edit::push_back :
+                                              r.op == journal_op::push_front ? edit::push_front :
+                                              r.op == journal_op::pop_back ? edit::pop_back :
+                                              r.op == journal_op::pop_front ? edit::pop_front : edit::remove);
+                if (kind == edit::remove && r.op != journal_op::remove)
+                    return false;
+                edits.push_back({kind, r.x, r.tm});
+            }
+            return apply_transaction(edits);
+        }
+        for (const journal_record<T>& r : update) {
+            bool push = (r.op == journal_op::push_back || r.op == journal_op::push_front);
+            bool pop = (r.op == journal_op::pop_back || r.op == journal_op::pop_front);
+            bool back_op = (r.op == journal_op::push_back || r.op == journal_op::pop_back);
+            if (r.op == journal_op::clear)
+                clear();
+            else if (!(push ? insert_push_operation(r.x, r.tm, back_op) :
+                       pop ? insert_pop_operation(r.tm, back_op) :
+                       r.op == journal_op::remove && delete_operation(r.tm)))
+                return false;
+        }
+        return true;
+    }
+
+
+    /*** Snapshots ***/
+    /// Writes a snapshot (see snapshot.h) of the deque, whose elements have to be trivially
+    /// copyable: its operations in time order, with their times, pushed elements (T() for
+    /// pops) and kinds (bit 0 set for a push, bit 1 for an operation on the back), and the
+    /// image of the treap, its nodes in pre-order (see snapshot_node), along with the position
+    /// of the journal. load_snapshot() rebuilds the treap from the operations alone.
+    /// retroactive_deque_view queries such a file in place.
+    bool save_snapshot(const std::string& path) const {
+        std::vector<const treap*> ops;
+        treap::fill_vector(tree, ops);
+        std::vector<long long> times;
+        std::vector<T> values;
+        std::vector<uint8_t> kinds;
+        times.reserve(ops.size());
+        values.reserve(ops.size());
+        kinds.reserve(ops.size());
+        for (const treap *op : ops) {
+            times.push_back(op->tm);
+            values.push_back(op->value);
+            kinds.push_back((op->ins ? 1 : 0) | (op->back ? 2 : 0));
+        }
+        std::vector<snapshot_node> nodes;
+        uint64_t saved = 0;
+        if (tree)
+            treap::save(tree, nodes, saved);
+
+        snapshot_writer writer(snapshot_kind::deque, sizeof(T), journal ? journal->position() : 0);
+        writer.add(times);
+        writer.add(values);
+        writer.add(kinds);
+        writer.add(nodes);
+        return writer.write(path);
+    }
+
+    /// Replaces the contents of the deque with a snapshot in O(n): the nodes are linked into
+    /// the treap at once instead of being inserted one by one. Returns false and leaves the
+    /// deque as it was if the file can't be read, isn't a snapshot of a retroactive_deque<T>
+    /// or holds an invalid history. The other versions sharing nodes with the deque keep them.
+    bool load_snapshot(const std::string& path) {
+        snapshot_file file;
+        const long long *times;
+        const T *values;
+        const uint8_t *kinds;
+        size_t n, value_count, kind_count;
+        if (!file.open(path, snapshot_kind::deque, sizeof(T)) || !file.section(section_times, times, n) ||
+                !file.section(section_values, values, value_count) || !file.section(section_kinds, kinds, kind_count) ||
+                value_count != n || kind_count != n)
+            return false;
+        for (size_t i = 1; i < n; ++i)
+            if (times[i] <= times[i - 1])
+                return false;
+
+        retroactive_deque<T> loaded;
+        std::vector<treap*> sorted;
+        sorted.reserve(n);
+        for (size_t i = 0; i < n; ++i)
+            sorted.push_back(loaded.pool().create(times[i], (kinds[i] & 1) != 0, (kinds[i] & 2) != 0,
+                                                  (kinds[i] & 1) ? values[i] : T()));
+        loaded.tree = treap::build(sorted);
+        if (!loaded.check_valid())
+            return false;
+        contents_range r = loaded.contents();
+        loaded.present.assign(r.begin(), r.end());
+#ifdef RETROACTIVE_STATS
+        loaded.pool().counters = pool().counters;
+#endif
+        *this = std::move(loaded);
+        return true;
+    }
+
+#ifdef RETROACTIVE_STATS
+    /// Shape of the treap and bytes of the node pool. The counters belong to the pool, so they
+    /// add up the updates of all the copies sharing it. The treap is the log, so there is no
+    /// separate operations storage; sequences_bytes is the copy of the present contents.
+    retroactive_stats stats() const {
+        retroactive_stats s;
+        if (nodes) {
+            s.counters = nodes->counters;
+            s.tree_bytes = nodes->blocks.size() * node_pool::block_size * sizeof(treap);
+        }
+        s.sequences_bytes = present.size() * sizeof(T);
+        treap::measure(tree, 1, s);
+        return s;
+    }
+#endif
 };
 
 
 /*** Friend operators implementation ***/
 template<class T>
 inline bool operator==(const retroactive_deque<T>& x, const retroactive_deque<T>& y) {
-    return x.operations == y.operations && x.pop_operations == y.pop_operations;
+    typedef typename retroactive_deque<T>::treap treap;
+    return treap::equal(x.tree, y.tree);
 }
 
 template<class T>
@@ -366,4 +1256,9 @@ inline bool operator!=(const retroactive_deque<T>& x, const retroactive_deque<T>
     return !(x == y);
 }
 
+template<class T>
+inline void swap(retroactive_deque<T>& x, retroactive_deque<T>& y) noexcept {
+    x.swap(y);
+}
+
 #endif // RETROACTIVE_DEQUE_H_INCLUDED
@@ -0,0 +1,213 @@
+#ifndef RETROACTIVE_DEQUE_VIEW_H_INCLUDED
+#define RETROACTIVE_DEQUE_VIEW_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "../common/snapshot.h"
+#include "retroactive_deque.h"
+
+/// Read-only retroactive_deque answering queries straight from a snapshot mapped into memory
+/// (see retroactive_deque::save_snapshot). Opening it is O(1) whatever the size of the
+/// snapshot, and a query makes the same O(log n) descents of the treap as retroactive_deque,
+/// on the image of the treap, whose nodes keep the aggregates of their subtrees. Only the
+/// pages the queries touch are ever read. A broken file can give wrong answers, but never
+/// reads outside of it.
+template<typename T>
+class retroactive_deque_view {
+
+private:
+    typedef retroactive_deque<T> container;
+    typedef typename container::snapshot_node node;
+
+    snapshot_file file;
+    const node *nodes;
+    const long long *times;
+    const T *values;
+    const uint8_t *kinds;
+    size_t node_count, op_count;
+
+    /// Whether n refers to an operation of the snapshot and its aggregates are within the
+    /// number of operations, which keeps the sums of the searches from overflowing.
+    inline bool usable(const node& n) const {
+        long long bound = static_cast<long long>(op_count);
+        if (n.op >= op_count || n.balance < -bound || n.balance > bound)
+            return false;
+        for (int back = 0; back < 2; ++back)
+            if (n.side_balance[back] < -bound || n.side_balance[back] > bound || n.min_suff[back] < -bound ||
+                    n.min_suff[back] > bound || n.max_suff[back] < -bound || n.max_suff[back] > bound)
+                return false;
+        return true;
+    }
+
+    /// The child of t at index next, or nullptr if there is no such child: children always
+    /// come after their parent.
+    inline const node *child(const node *t, uint64_t next) const {
+        size_t i = static_cast<size_t>(t - nodes);
+        return (next <= i || next >= node_count || !usable(nodes[next])) ? nullptr : nodes + next;
+    }
+
+    inline const node *root() const {
+        return node_count > 0 && usable(nodes[0]) ? nodes : nullptr;
+    }
+
+    inline long long time_of(const node *t) const { return times[t->op]; }
+
+    inline long long weight(const node *t) const { return (kinds[t->op] & 1) ? 1 : -1; }
+
+    inline long long weight(const node *t, bool back) const {
+        return ((kinds[t->op] & 2) != 0) == back ? weight(t) : 0;
+    }
+
+    static inline long long get_balance(const node *t) { return t ? t->balance : 0; }
+
+    static inline long long get_balance(const node *t, bool back) { return t ? t->side_balance[back] : 0; }
+
+    static inline long long get_min_suff(const node *t, bool back) { return t ? t->min_suff[back] : 0; }
+
+    static inline long long get_max_suff(const node *t, bool back) { return t ? t->max_suff[back] : 0; }
+
+    /// The latest operation of one side of the subtree of t whose suffix balance among the
+    /// operations of that side is k, see retroactive_deque::treap::get_kth.
+    const node *get_kth(const node *t, long long k, bool back) const { // 1-indexing
+        while (t) {
+            const node *r = child(t, t->right);
+            if (r && k >= get_min_suff(r, back) && k <= get_max_suff(r, back)) {
+                t = r;
+                continue;
+            }
+            long long right_balance = get_balance(r, back) + weight(t, back);
+            if (right_balance == k)
+                return t;
+            k -= right_balance;
+            t = child(t, t->left);
+        }
+        return nullptr;
+    }
+
+    /// The same among the operations with time <= x. The nodes with time <= x on the search
+    /// path of x, each one followed by its left subtree, cover those operations from the
+    /// latest to the earliest when taken from the end of the path.
+    const node *get_prefix_kth(long long x, long long k, bool back) const { // 1-indexing
+        std::vector<const node*> path;
+        for (const node *t = root(); t; ) {
+            if (time_of(t) <= x) {
+                path.push_back(t);
+                t = child(t, t->right);
+            } else
+                t = child(t, t->left);
+        }
+        long long balance = 0;
+        for (size_t i = path.size(); i-- > 0; ) {
+            const node *t = path[i], *l = child(t, t->left);
+            balance += weight(t, back);
+            if (balance == k)
+                return t;
+            if (l && k - balance >= get_min_suff(l, back) && k - balance <= get_max_suff(l, back))
+                return get_kth(l, k - balance, back);
+            balance += get_balance(l, back);
+        }
+        return nullptr;
+    }
+
+    /// The i-th element (0-indexing) of the deque of size cur_size at time tm, see
+    /// retroactive_deque::get_element.
+    const T *get_element(long long i, long long cur_size, long long tm) const {
+        if (i < 0 || i >= cur_size)
+            return nullptr;
+        const node *l = get_prefix_kth(tm, i + 1, false), *r = get_prefix_kth(tm, cur_size - i, true);
+        const node *t = (!l || (r && time_of(r) > time_of(l))) ? r : l;
+        return t && (kinds[t->op] & 1) ? &values[t->op] : nullptr;
+    }
+
+    static const T& default_value() {
+        static const T value = T();
+        return value;
+    }
+
+public:
+    retroactive_deque_view<T>() : file(), nodes(nullptr), times(nullptr), values(nullptr), kinds(nullptr),
+            node_count(0), op_count(0) { }
+
+    bool open(const std::string& path) {
+        close();
+        size_t value_count, kind_count;
+        if (!file.open(path, snapshot_kind::deque, sizeof(T)) ||
+                !file.section(container::section_times, times, op_count) ||
+                !file.section(container::section_values, values, value_count) ||
+                !file.section(container::section_kinds, kinds, kind_count) ||
+                !file.section(container::section_nodes, nodes, node_count) ||
+                value_count != op_count || kind_count != op_count) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        file.close();
+        nodes = nullptr;
+        times = nullptr;
+        values = nullptr;
+        kinds = nullptr;
+        node_count = op_count = 0;
+    }
+
+    inline bool is_open() const {
+        return file.is_open();
+    }
+
+    /// Number of elements at time tm: the balance of the operations up to it.
+    size_t size(long long tm = std::numeric_limits<long long>::max()) const {
+        long long balance = 0;
+        for (const node *t = root(); t; ) {
+            if (time_of(t) <= tm) {
+                const node *l = child(t, t->left);
+                balance += get_balance(l) + weight(t);
+                t = child(t, t->right);
+            } else
+                t = child(t, t->left);
+        }
+        return balance > 0 ? static_cast<size_t>(balance) : 0;
+    }
+
+    inline bool empty(long long tm = std::numeric_limits<long long>::max()) const {
+        return size(tm) == 0;
+    }
+
+    /// Like in retroactive_deque, the elements point into the snapshot and stay valid until
+    /// close(), and nullptr stands for an empty deque or an index out of range.
+    const T *try_back(long long tm = std::numeric_limits<long long>::max()) const {
+        long long cur_size = static_cast<long long>(size(tm));
+        return get_element(cur_size - 1, cur_size, tm);
+    }
+
+    const T *try_front(long long tm = std::numeric_limits<long long>::max()) const {
+        return get_element(0, static_cast<long long>(size(tm)), tm);
+    }
+
+    const T *try_at(size_t i, long long tm = std::numeric_limits<long long>::max()) const {
+        long long cur_size = static_cast<long long>(size(tm));
+        return i < static_cast<size_t>(cur_size) ? get_element(static_cast<long long>(i), cur_size, tm) : nullptr;
+    }
+
+    const T& back(long long tm = std::numeric_limits<long long>::max()) const {
+        const T *x = try_back(tm);
+        return x ? *x : default_value();
+    }
+
+    const T& front(long long tm = std::numeric_limits<long long>::max()) const {
+        const T *x = try_front(tm);
+        return x ? *x : default_value();
+    }
+
+    const T& at(size_t i, long long tm = std::numeric_limits<long long>::max()) const {
+        const T *x = try_at(i, tm);
+        return x ? *x : default_value();
+    }
+};
+
+#endif // RETROACTIVE_DEQUE_VIEW_H_INCLUDED
@@ -0,0 +1,91 @@
+#include <iostream>
+#include <limits>
+#include <map>
+#include <set>
+#include <utility>
+
+#include "../common/benchmark.h"
+#include "retroactive_set.h"
+
+using namespace std;
+
+/// Updates are insertions (add) or erasures of the value. Queries are lower_bound (side) or
+/// find of the value at their time.
+template<typename Bucket>
+struct set_subject {
+    retroactive_set<int, Bucket> s;
+
+    long long apply(const workload_op& op) {
+        switch (op.kind) {
+        case workload_op::update:
+            return op.add ? s.insert(op.value, op.tm) : s.erase(op.value, op.tm);
+        case workload_op::remove:
+            return s.delete_operation(op.tm);
+        default:
+            return op.side ? s.lower_bound(op.value, op.tm) : s.find(op.value, op.tm);
+        }
+    }
+};
+
+struct tree_bucket_subject : set_subject<retroactive_set_tree_bucket<int>> {
+    static const char *name() {
+        return "tree buckets";
+    }
+};
+
+struct flat_bucket_subject : set_subject<retroactive_set_flat_bucket<int>> {
+    static const char *name() {
+        return "flat buckets";
+    }
+};
+
+/// Keeps the log of operations only and replays it for every query and update.
+struct set_baseline {
+    map<long long, pair<int, bool>> log; // time -> (element, is insert operation)
+
+    static const char *name() {
+        return "naive replay";
+    }
+
+    bool present(int x, long long tm) const {
+        bool ans = false;
+        for (auto it = log.begin(); it != log.end() && it->first <= tm; ++it)
+            if (it->second.first == x)
+                ans = it->second.second;
+        return ans;
+    }
+
+    long long apply(const workload_op& op) {
+        switch (op.kind) {
+        case workload_op::update:
+            if (log.count(op.tm) || present(op.value, op.tm) == op.add)
+                return false;
+            log.emplace(op.tm, make_pair(op.value, op.add));
+            return true;
+        case workload_op::remove:
+            return log.erase(op.tm) > 0;
+        default: {
+            if (!op.side)
+                return present(op.value, op.tm);
+            set<int> elements;
+            for (auto it = log.begin(); it != log.end() && it->first <= op.tm; ++it)
+                if (it->second.second)
+                    elements.insert(it->second.first);
+                else
+                    elements.erase(it->second.first);
+            auto found = elements.lower_bound(op.value);
+            return found == elements.end() ? numeric_limits<int>::max() : *found;
+        }
+        }
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    benchmark_options options;
+    if (!parse_benchmark_options(argc, argv, options)) {
+        cerr << "usage: " << argv[0] << " [--ops N,...] [--mix NAME,...] [--seed S] [--keys K] [--baseline-limit N]" << endl;
+        return 2;
+    }
+    return benchmark_suite<set_baseline, tree_bucket_subject, flat_bucket_subject>::run(options);
+}
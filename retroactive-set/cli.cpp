@@ -2,12 +2,22 @@
 #include <iostream>
 #include <limits>
 #include <string>
+#include <vector>
 
+#include "../common/cli_io.h"
 #include "retroactive_set.h"
 
 using namespace std;
 
-void run(istream& cin, bool allow_files = false) {
+/// Operation codes of the binary log (see binary_reader): the index of each command.
+const vector<string> binary_operations = {
+    "finish", "insert", "insert_retro", "erase", "erase_retro", "delete_operation", "lower_bound",
+    "lower_bound_retro", "upper_bound", "upper_bound_retro", "find", "find_retro", "run", "clear", "stats",
+    "save", "load"
+};
+
+template<typename Input>
+void run(Input& cin, bool allow_files = false) {
 
     retroactive_set<int> s;
 
@@ -15,90 +25,125 @@ void run(istream& cin, bool allow_files = false) {
     int x;
     long long tm;
 
-    while ((cin >> operation) && operation != "finish") {
+    while (cin.read_operation(operation) && operation != "finish") {
         if (operation == "insert") {
             cin >> x;
             bool success = s.insert(x);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "insert_retro") {
             cin >> x >> tm;
             bool success = s.insert(x, tm);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "erase") {
             cin >> x;
             bool success = s.erase(x);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "erase_retro") {
             cin >> x >> tm;
             bool success = s.erase(x, tm);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "delete_operation") {
             cin >> tm;
             bool success = s.delete_operation(tm);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "lower_bound") {
             cin >> x;
             int answer = s.lower_bound(x);
             if (answer == numeric_limits<int>::max())
-                cout << "No such element" << endl;
+                cout << "No such element" << '\n';
             else
-                cout << answer << endl;
+                cout << answer << '\n';
 
         } else if (operation == "lower_bound_retro") {
             cin >> x >> tm;
             int answer = s.lower_bound(x, tm);
             if (answer == numeric_limits<int>::max())
-                cout << "No such element" << endl;
+                cout << "No such element" << '\n';
             else
-                cout << answer << endl;
+                cout << answer << '\n';
 
         } else if (operation == "upper_bound") {
             cin >> x;
             int answer = s.upper_bound(x);
             if (answer == numeric_limits<int>::max())
-                cout << "No such element" << endl;
+                cout << "No such element" << '\n';
             else
-                cout << answer << endl;
+                cout << answer << '\n';
 
         } else if (operation == "upper_bound_retro") {
             cin >> x >> tm;
             int answer = s.upper_bound(x, tm);
             if (answer == numeric_limits<int>::max())
-                cout << "No such element" << endl;
+                cout << "No such element" << '\n';
             else
-                cout << answer << endl;
+                cout << answer << '\n';
 
         } else if (operation == "find") {
             cin >> x;
             bool success = s.find(x);
-            cout << (success ? "found" : "not found") << endl;
+            cout << (success ? "found" : "not found") << '\n';
 
         } else if (operation == "find_retro") {
             cin >> x >> tm;
             bool success = s.find(x, tm);
-            cout << (success ? "found" : "not found") << endl;
+            cout << (success ? "found" : "not found") << '\n';
+
+        } else if (operation == "save") {
+            string filename;
+            cin >> filename;
+            bool success = s.save_snapshot(filename);
+            cout << (success ? "ok" : "not ok") << '\n';
+
+        } else if (operation == "load") {
+            string filename;
+            cin >> filename;
+            bool success = s.load_snapshot(filename);
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "run" && allow_files) {
             string filename;
             cin >> filename;
             ifstream fin(filename);
-            run(fin);
+            Input file_in = cin.nested(fin);
+            run(file_in);
 
         } else if (operation == "clear") {
             s.clear();
 
+        } else if (operation == "stats") {
+#ifdef RETROACTIVE_STATS
+            s.stats().write(cout, "retroactive_set");
+#else
+            cout << "not ok" << '\n'; // built without RETROACTIVE_STATS
+#endif
+
         }
     }
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    run(cin, true);
+    // --batch: text commands parsed by hand, output not flushed after each command
+    // --binary: binary operation log (see binary_reader)
+    cli_mode mode = parse_cli_mode(argc, argv);
+    if (mode != cli_mode::interactive)
+        setup_batch_output();
+
+    if (mode == cli_mode::binary) {
+        binary_reader in(cin, binary_operations);
+        run(in, true);
+    } else if (mode == cli_mode::batch) {
+        text_reader in(cin);
+        run(in, true);
+    } else {
+        stream_reader in(cin);
+        run(in, true);
+    }
 
     return 0;
 }
@@ -2,19 +2,133 @@
 #define RETROACTIVE_SET_H_INCLUDED
 
 #include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <limits>
 #include <map>
 #include <set>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include "../common/journal.h"
+#include "../common/operation_log.h"
+#include "../common/retroactive_stats.h"
+#include "../common/snapshot.h"
+
+/// Bucket policies for the nodes of retroactive_set's segment tree. A bucket keeps a set of
+/// elements in the sorted container items and answers lower_bound/upper_bound queries with
+/// a pointer to the found element or nullptr. assign() replaces the items with a sorted vector
+/// of distinct elements. With RETROACTIVE_STATS, bytes() estimates the memory held by the
+/// bucket.
+
+/// Balanced search tree: O(log n) updates, but a pointer chase per probe.
+template<typename T>
+struct retroactive_set_tree_bucket {
+    std::set<T> items;
+
+    inline void insert(const T& x) {
+        items.insert(x);
+    }
+
+    inline void erase(const T& x) {
+        items.erase(x);
+    }
+
+    inline void assign(std::vector<T>&& sorted) { // linear, since the input is sorted
+        items = std::set<T>(sorted.begin(), sorted.end());
+    }
+
+    inline const T *lower_bound(const T& x) const {
+        auto it = items.lower_bound(x);
+        return it != items.end() ? &*it : nullptr;
+    }
+
+    inline const T *upper_bound(const T& x) const {
+        auto it = items.upper_bound(x);
+        return it != items.end() ? &*it : nullptr;
+    }
+
+#ifdef RETROACTIVE_STATS
+    inline size_t bytes() const {
+        return items.size() * retroactive_stats::tree_node_bytes<T>();
+    }
+#endif
+};
+
+/// Sorted contiguous array: cache-friendly probes for query-heavy workloads, O(1) appends of
+/// elements greater than all the others, but O(bucket size) insertions in the middle.
 template<typename T>
+struct retroactive_set_flat_bucket {
+    std::vector<T> items;
+
+    inline void insert(const T& x) {
+        if (items.empty() || items.back() < x)
+            items.push_back(x);
+        else
+            items.insert(std::lower_bound(items.begin(), items.end(), x), x);
+    }
+
+    inline void erase(const T& x) {
+        auto it = std::lower_bound(items.begin(), items.end(), x);
+        if (it != items.end() && !(x < *it))
+            items.erase(it);
+    }
+
+    inline void assign(std::vector<T>&& sorted) {
+        items = std::move(sorted);
+    }
+
+    inline const T *lower_bound(const T& x) const {
+        auto it = std::lower_bound(items.begin(), items.end(), x);
+        return it != items.end() ? &*it : nullptr;
+    }
+
+    inline const T *upper_bound(const T& x) const {
+        auto it = std::upper_bound(items.begin(), items.end(), x);
+        return it != items.end() ? &*it : nullptr;
+    }
+
+#ifdef RETROACTIVE_STATS
+    inline size_t bytes() const {
+        return items.capacity() * sizeof(T);
+    }
+#endif
+};
+
+template<typename T, typename Bucket = retroactive_set_tree_bucket<T>>
 class retroactive_set {
 
+public:
+    typedef T value_type;
+
+    /// A node of the segment tree in a snapshot: its children (0 for none, the root is node 0)
+    /// and its bucket, [first, last) of the items.
+    struct snapshot_node {
+        uint64_t left, right, first, last;
+    };
+
 private:
+    struct interval { // x is present at the times [l, r]
+        long long l, r;
+        T x;
+    };
+
     struct segtree {
+        /// Fractional cascading: the cascade of a node is its bucket merged with every second
+        /// entry of the cascades of its children, plus a sentinel entry at the end.
+        struct cascade_entry {
+            T value;
+            T own; // first element of the bucket >= value, stored inline to save a cache miss
+            unsigned left, right; // first entries of the children's cascades >= value
+        };
+
         segtree *L, *R;
-        std::set<T> bucket;
+        Bucket bucket;
+        std::vector<cascade_entry> cascade; // empty unless the index is built
 
-        segtree() : L(nullptr), R(nullptr), bucket() { }
+        segtree() : L(nullptr), R(nullptr), bucket(), cascade() { }
 
         void add(long long l, long long r, const T& x,
                  long long tl = std::numeric_limits<long long>::min(),
@@ -36,6 +150,44 @@ private:
             }
         }
 
+        /// Builds the subtree of [tl, tr] from intervals sorted by their elements, splitting
+        /// them like add() does. The children are built by separate threads while there are
+        /// threads left. The intervals are released before descending.
+        void build(std::vector<interval>&& items, long long tl, long long tr, unsigned threads) {
+            long long tm = (tl >> 1) + (tr >> 1) + (tl & tr & 1LL); // overflow-safe calculation of mean value
+            std::vector<T> own;
+            std::vector<interval> left, right;
+            for (const interval& it : items) {
+                if (it.l == tl && it.r == tr)
+                    own.push_back(it.x);
+                else {
+                    if (it.l <= tm)
+                        left.push_back({it.l, std::min(it.r, tm), it.x});
+                    if (it.r > tm)
+                        right.push_back({std::max(it.l, tm + 1), it.r, it.x});
+                }
+            }
+            std::vector<interval>().swap(items);
+            this->bucket.assign(std::move(own));
+
+            if (!left.empty())
+                this->L = new segtree();
+            if (!right.empty())
+                this->R = new segtree();
+            if (this->L && this->R && threads > 1) {
+                std::thread worker([this, &left, tl, tm, threads] {
+                    this->L->build(std::move(left), tl, tm, threads / 2);
+                });
+                this->R->build(std::move(right), tm + 1, tr, threads - threads / 2);
+                worker.join();
+            } else {
+                if (this->L)
+                    this->L->build(std::move(left), tl, tm, threads);
+                if (this->R)
+                    this->R->build(std::move(right), tm + 1, tr, threads);
+            }
+        }
+
         void remove(long long l, long long r, const T& x,
                     long long tl = std::numeric_limits<long long>::min(),
                     long long tr = std::numeric_limits<long long>::max()) {
@@ -56,9 +208,9 @@ private:
             T ans = std::numeric_limits<T>::max(); // we assume for now that the type T is numeric
             segtree *tree = this;
             while (tree) {
-                auto bucket_it = tree->bucket.lower_bound(x);
-                if (bucket_it != tree->bucket.end())
-                    ans = std::min(ans, *bucket_it);
+                const T *found = tree->bucket.lower_bound(x);
+                if (found)
+                    ans = std::min(ans, *found);
 
                 long long tm = (tl >> 1) + (tr >> 1) + (tl & tr & 1LL); // overflow-safe calculation of mean value
                 if (t <= tm) {
@@ -78,9 +230,9 @@ private:
             T ans = std::numeric_limits<T>::max(); // we assume for now that the type T is numeric
             segtree *tree = this;
             while (tree) {
-                auto bucket_it = tree->bucket.upper_bound(x);
-                if (bucket_it != tree->bucket.end())
-                    ans = std::min(ans, *bucket_it);
+                const T *found = tree->bucket.upper_bound(x);
+                if (found)
+                    ans = std::min(ans, *found);
 
                 long long tm = (tl >> 1) + (tr >> 1) + (tl & tr & 1LL); // overflow-safe calculation of mean value
                 if (t <= tm) {
@@ -94,6 +246,143 @@ private:
             return ans;
         }
 
+        /// lower_bound (strict = false) or upper_bound (strict = true) at every time of the sorted
+        /// range [first, last) into out, which visits each node shared by their paths only once.
+        void bound_at(const long long *first, const long long *last, const T& x, bool strict, T ans, T *out,
+                      long long tl, long long tr) const {
+            const T *found = (strict ? this->bucket.upper_bound(x) : this->bucket.lower_bound(x));
+            if (found)
+                ans = std::min(ans, *found);
+
+            long long tm = (tl >> 1) + (tr >> 1) + (tl & tr & 1LL); // overflow-safe calculation of mean value
+            const long long *middle = std::upper_bound(first, last, tm);
+            if (first != middle) {
+                if (this->L)
+                    this->L->bound_at(first, middle, x, strict, ans, out, tl, tm);
+                else
+                    std::fill(out, out + (middle - first), ans);
+            }
+            if (middle != last) {
+                if (this->R)
+                    this->R->bound_at(middle, last, x, strict, ans, out + (middle - first), tm + 1, tr);
+                else
+                    std::fill(out + (middle - first), out + (last - first), ans);
+            }
+        }
+
+        /// The same as lower_bound (strict = false) and upper_bound (strict = true), but the
+        /// bucket is searched only in the root, the other levels take O(1) via the cascades.
+        T cascaded_bound(long long t, const T& x, bool strict, long long tl, long long tr) const {
+            T ans = std::numeric_limits<T>::max(); // we assume for now that the type T is numeric
+            const segtree *tree = this;
+            auto before = [&x, strict](const cascade_entry& e) { return strict ? !(x < e.value) : e.value < x; };
+            size_t pos = std::partition_point(cascade.begin(), cascade.end() - 1, before) - cascade.begin();
+            while (tree) {
+                const cascade_entry& e = tree->cascade[pos];
+                ans = std::min(ans, e.own);
+
+                long long tm = (tl >> 1) + (tr >> 1) + (tl & tr & 1LL); // overflow-safe calculation of mean value
+                if (t <= tm) {
+                    tree = tree->L;
+                    pos = e.left;
+                    tr = tm;
+                } else {
+                    tree = tree->R;
+                    pos = e.right;
+                    tl = tm + 1;
+                }
+                if (tree && pos > 0 && !before(tree->cascade[pos - 1])) // at most one skipped entry
+                    --pos;
+            }
+            return ans;
+        }
+
+        void build_cascade() {
+            if (this->L)
+                this->L->build_cascade();
+            if (this->R)
+                this->R->build_cascade();
+
+            std::vector<T> sampled, merged, values;
+            for (segtree *child : {this->L, this->R})
+                if (child) {
+                    merged.clear();
+                    for (size_t i = 1; i + 1 < child->cascade.size(); i += 2)
+                        merged.push_back(child->cascade[i].value);
+                    values.clear();
+                    std::merge(sampled.begin(), sampled.end(), merged.begin(), merged.end(), std::back_inserter(values));
+                    sampled.swap(values);
+                }
+            values.clear();
+            std::merge(this->bucket.items.begin(), this->bucket.items.end(), sampled.begin(), sampled.end(),
+                       std::back_inserter(values));
+
+            this->cascade.clear();
+            this->cascade.reserve(values.size() + 1);
+            auto own_it = this->bucket.items.begin();
+            unsigned left = 0, right = 0;
+            for (const T& value : values) {
+                while (own_it != this->bucket.items.end() && *own_it < value)
+                    ++own_it;
+                while (this->L && left + 1 < this->L->cascade.size() && this->L->cascade[left].value < value)
+                    ++left;
+                while (this->R && right + 1 < this->R->cascade.size() && this->R->cascade[right].value < value)
+                    ++right;
+                this->cascade.push_back({value, own_it != this->bucket.items.end() ? *own_it : std::numeric_limits<T>::max(),
+                                         left, right});
+            }
+            this->cascade.push_back({T(), std::numeric_limits<T>::max(), this->L ? unsigned(this->L->cascade.size() - 1) : 0,
+                                     this->R ? unsigned(this->R->cascade.size() - 1) : 0});
+        }
+
+        void drop_cascade() {
+            std::vector<cascade_entry>().swap(this->cascade);
+            if (this->L)
+                this->L->drop_cascade();
+            if (this->R)
+                this->R->drop_cascade();
+        }
+
+#ifdef RETROACTIVE_STATS
+        void measure(size_t depth, retroactive_stats& s) const {
+            s.add_node(depth);
+            s.tree_bytes += sizeof(segtree) + this->bucket.bytes() + this->cascade.capacity() * sizeof(cascade_entry);
+            if (this->L)
+                this->L->measure(depth + 1, s);
+            if (this->R)
+                this->R->measure(depth + 1, s);
+        }
+#endif
+
+        /// Appends the image of the subtree in pre-order, so every node comes after its parent.
+        void save(std::vector<snapshot_node>& image, std::vector<T>& items) const {
+            size_t i = image.size();
+            image.push_back({0, 0, items.size(), 0});
+            for (const T& x : this->bucket.items)
+                items.push_back(x);
+            image[i].last = items.size();
+            if (this->L) {
+                image[i].left = image.size();
+                this->L->save(image, items);
+            }
+            if (this->R) {
+                image[i].right = image.size();
+                this->R->save(image, items);
+            }
+        }
+
+        void load(const snapshot_node *image, size_t i, const T *items) {
+            this->bucket.assign(std::vector<T>(items + image[i].first, items + image[i].last));
+            if (image[i].left) {
+                this->L = new segtree();
+                this->L->load(image, image[i].left, items);
+            }
+            if (image[i].right) {
+                this->R = new segtree();
+                this->R->load(image, image[i].right, items);
+            }
+        }
+
         void destroy() {
             if (this->L)
                 this->L->destroy();
@@ -115,111 +404,397 @@ private:
         }
     };
 
-    std::map<long long, T> operations;
-    std::map<T, std::vector<long long>> sequences;
-    segtree *tree;
-
+    operation_log<T> operations;
+    std::map<T, std::map<long long, bool>> sequences; // (time/is insert operation)
+    segtree *tree; // nullptr until the first update
+    long long first_time, last_time; // time domain covered by the segment tree
+    bool cascaded; // whether the fractional cascading index is built
+    retroactive_journal<T> *journal; // nullptr if none is attached
+#ifdef RETROACTIVE_STATS
+    retroactive_counters counters;
+#endif
+
+    /// The time of the next update at the present: after all the operations, and not before
+    /// the time domain, so the first one of a bounded set starts it. Past the domain it is
+    /// rejected like any other time.
     inline long long get_last_time() {
-        return operations.empty() ? 0 : operations.rbegin()->first + 1;
+        return std::max(operations.next_time(), first_time);
+    }
+
+    inline void log_update(journal_op op, const T& x, long long tm) {
+        if (journal) {
+            journal_record<T> update = {op, x, tm};
+            journal->record(&update, 1);
+        }
+    }
+
+    /// clear() without recording it, for the moved-from sets and build_from().
+    void clear_contents() {
+        operations.clear();
+        sequences.clear();
+        if (tree)
+            tree->destroy();
+        tree = nullptr;
+        cascaded = false;
+    }
+
+    inline void add_interval(long long l, long long r, const T& x) {
+        if (!tree)
+            tree = new segtree();
+        drop_index();
+        tree->add(l, r, x, first_time, last_time);
+    }
+
+    inline void remove_interval(long long l, long long r, const T& x) {
+        drop_index();
+        tree->remove(l, r, x, first_time, last_time);
+    }
+
+    /// An element is present from each of its "insert" operations up to its next operation,
+    /// so the segment tree keeps the interval [tm, interval_end(...)] for every insert at tm.
+    /// Any operation can thus be added or deleted by fixing the intervals of its neighbours.
+    inline long long interval_end(const std::map<long long, bool>& events,
+                                  std::map<long long, bool>::const_iterator next) const {
+        return next == events.end() ? last_time : next->first - 1;
+    }
+
+    bool add_event(const T& x, long long tm, bool ins) {
+        RETROACTIVE_COUNT(counters.updates);
+        if (tm < first_time || tm > last_time || operations.contains(tm))
+            return false;
+
+        std::map<long long, bool>& events = sequences[x];
+        auto next = events.upper_bound(tm);
+        bool present = (next != events.begin() && std::prev(next)->second);
+        if (present == ins) { // inserting a present element or erasing an absent one
+            if (events.empty())
+                sequences.erase(x);
+            return false;
+        }
+
+        long long end = interval_end(events, next);
+        if (ins)
+            add_interval(tm, end, x);
+        else { // cut the interval of the previous "insert" operation
+            long long prev_tm = std::prev(next)->first;
+            remove_interval(prev_tm, end, x);
+            add_interval(prev_tm, tm - 1, x);
+        }
+        events.emplace_hint(next, tm, ins);
+        operations.insert(tm, x);
+        log_update(ins ? journal_op::insert : journal_op::erase, x, tm);
+        return true;
+    }
+
+    std::vector<T> bound_at(const T& x, const std::vector<long long>& times, bool strict) {
+        std::vector<T> ans(times.size(), std::numeric_limits<T>::max());
+        if (!tree)
+            return ans;
+        if (!std::is_sorted(times.begin(), times.end())) {
+            for (size_t i = 0; i < times.size(); ++i)
+                ans[i] = (strict ? upper_bound(x, times[i]) : lower_bound(x, times[i]));
+            return ans;
+        }
+
+        size_t first = std::lower_bound(times.begin(), times.end(), first_time) - times.begin();
+        std::vector<long long> clamped(times.begin() + first, times.end()); // still sorted
+        for (long long& tm : clamped)
+            tm = std::min(tm, last_time);
+        if (!clamped.empty())
+            tree->bound_at(clamped.data(), clamped.data() + clamped.size(), x, strict, std::numeric_limits<T>::max(),
+                           ans.data() + first, first_time, last_time);
+        return ans;
+    }
+
+    /// std::sort of [first, last) with up to threads threads: the two halves are sorted in
+    /// parallel and then merged.
+    template<typename It, typename Compare>
+    static void parallel_sort(It first, It last, Compare less, unsigned threads) {
+        if (threads <= 1 || last - first < 1 << 16) {
+            std::sort(first, last, less);
+            return;
+        }
+        It middle = first + (last - first) / 2;
+        std::thread worker([first, middle, less, threads] {
+            parallel_sort(first, middle, less, threads / 2);
+        });
+        parallel_sort(middle, last, less, threads - threads / 2);
+        worker.join();
+        std::inplace_merge(first, middle, last, less);
+    }
+
+    inline void drop_index() {
+        if (cascaded) {
+            tree->drop_cascade();
+            cascaded = false;
+        }
     }
 
 public:
+    /// Sections of the snapshots, see save_snapshot().
+    enum snapshot_section {
+        section_bounds, section_times, section_values, section_inserted, section_nodes, section_items
+    };
+
+    /// One operation of build_from(): an insertion or an erasure of x at time tm.
+    struct edit {
+        enum kind_t { insert, erase };
+
+        kind_t kind;
+        T x;
+        long long tm;
+    };
+
     /*** Friend operators ***/
-    template<typename T1>
-        friend bool operator==(const retroactive_set<T1>& x, const retroactive_set<T1>& y);
-    template<typename T1>
-        friend bool operator!=(const retroactive_set<T1>& x, const retroactive_set<T1>& y);
+    template<typename T1, typename B1>
+        friend bool operator==(const retroactive_set<T1, B1>& x, const retroactive_set<T1, B1>& y);
+    template<typename T1, typename B1>
+        friend bool operator!=(const retroactive_set<T1, B1>& x, const retroactive_set<T1, B1>& y);
 
 
     /*** Constructors and destructor ***/
-    retroactive_set<T>() : operations(), sequences(), tree(new segtree()) { }
+    retroactive_set<T, Bucket>() : operations(), sequences(), tree(nullptr),
+            first_time(std::numeric_limits<long long>::min()), last_time(std::numeric_limits<long long>::max()),
+            cascaded(false), journal(nullptr) { }
+
+    /// Restricts operation times to [min_time, max_time], so the segment tree is only
+    /// about log2(max_time - min_time) levels deep instead of 64.
+    retroactive_set<T, Bucket>(long long min_time, long long max_time) : operations(), sequences(), tree(nullptr),
+            first_time(min_time), last_time(max_time), cascaded(false),
+            journal(nullptr) { }
+
+    retroactive_set<T, Bucket>(const retroactive_set<T, Bucket>& other) : operations(other.operations),
+            sequences(other.sequences), tree(nullptr), first_time(other.first_time), last_time(other.last_time),
+            cascaded(false), journal(nullptr) {
+        if (other.tree) {
+            tree = new segtree();
+            tree->copy(other.tree);
+        }
+    }
 
-    retroactive_set<T>(const retroactive_set<T>& other) {
-        operations = other.operations;
-        sequences = other.sequence;
-        tree = new segtree();
-        tree->copy(other.tree);
+    retroactive_set<T, Bucket>(retroactive_set<T, Bucket>&& other) noexcept : operations(std::move(other.operations)),
+            sequences(std::move(other.sequences)), tree(other.tree), first_time(other.first_time),
+            last_time(other.last_time), cascaded(other.cascaded), journal(nullptr) {
+        other.tree = nullptr;
+        other.cascaded = false;
+        other.clear_contents();
     }
 
-    ~retroactive_set<T>() {
-        tree->destroy();
+    ~retroactive_set<T, Bucket>() {
+        if (tree)
+            tree->destroy();
     }
 
 
     /*** Operators ***/
-    retroactive_set<T>& operator=(const retroactive_set<T>& other) {
+    retroactive_set<T, Bucket>& operator=(const retroactive_set<T, Bucket>& other) {
+        if (this == &other)
+            return *this;
         operations = other.operations;
         sequences = other.sequences;
-        tree->destroy();
-        tree = new segtree();
-        tree->copy(other.tree);
+        first_time = other.first_time;
+        last_time = other.last_time;
+        if (tree)
+            tree->destroy();
+        tree = nullptr;
+        cascaded = false;
+        if (other.tree) {
+            tree = new segtree();
+            tree->copy(other.tree);
+        }
         return *this;
     }
 
+    retroactive_set<T, Bucket>& operator=(retroactive_set<T, Bucket>&& other) noexcept {
+        if (this == &other)
+            return *this;
+        swap(other);
+        other.clear_contents();
+        return *this;
+    }
 
-    /*** Retroactive updates and queries ***/
-    bool insert(const T& x, long long tm) {
-        if (operations.find(tm) != operations.end())
-            return false;
+    void swap(retroactive_set<T, Bucket>& other) noexcept {
+        operations.swap(other.operations);
+        std::swap(sequences, other.sequences);
+        std::swap(tree, other.tree);
+        std::swap(first_time, other.first_time);
+        std::swap(last_time, other.last_time);
+        std::swap(cascaded, other.cascaded);
+#ifdef RETROACTIVE_STATS
+        std::swap(counters, other.counters);
+#endif
+    }
 
-        std::vector<long long>& events = sequences[x];
-        if (events.size() % 2 != 0 || (!events.empty() && events.back() > tm))
-            return false;
 
-        operations[tm] = x;
-        tree->add(tm, std::numeric_limits<long long>::max(), x);
-        events.push_back(tm);
-        return true;
+    /*** Retroactive updates and queries ***/
+    /// At any time, x is in the set iff its latest operation up to then is an insertion. An
+    /// insertion is rejected if x is already there just before tm and an erasure if it isn't,
+    /// but the later operations of x are left as they are: inserting or erasing x in the middle
+    /// of its history (or deleting one of its operations) may make its next operation insert
+    /// an x that is already there or erase one that isn't. Such an operation stays in the
+    /// history and changes nothing until an edit before it makes it count again, e.g. after
+    /// insert(x, 1), erase(x, 5) and erase(x, 3), x is absent from 3 on, and deleting the
+    /// operation at 3 brings it back until 5.
+    bool insert(const T& x, long long tm) {
+        return add_event(x, tm, true);
     }
 
     bool erase(const T& x, long long tm) {
-        if (operations.find(tm) != operations.end())
-            return false;
-
-        std::vector<long long>& events = sequences[x];
-        if (events.size() % 2 == 0 || events.back() > tm)
-            return false;
-
-        operations[tm] = x;
-        long long prev_tm = events.back();
-        tree->remove(prev_tm, std::numeric_limits<long long>::max(), x);
-        tree->add(prev_tm, tm - 1, x);
-        events.push_back(tm);
-        return true;
+        return add_event(x, tm, false);
     }
 
     bool delete_operation(long long tm) {
-        auto it = operations.find(tm);
-        if (it == operations.end())
+        RETROACTIVE_COUNT(counters.updates);
+        const T *x = operations.find(tm);
+        if (!x)
             return false;
 
-        std::vector<long long>& events = sequences[it->second];
-        if (events.back() != tm) // we can delete only last operation for each element
-            return false;
+        auto seq_it = sequences.find(*x);
+        std::map<long long, bool>& events = seq_it->second;
+        auto event_it = events.find(tm);
+        long long end = interval_end(events, std::next(event_it));
+        if (event_it->second) // delete "insert" operation
+            remove_interval(tm, end, *x);
+        if (event_it != events.begin() && std::prev(event_it)->second) { // the previous interval grows
+            long long prev_tm = std::prev(event_it)->first;
+            remove_interval(prev_tm, tm - 1, *x);
+            add_interval(prev_tm, end, *x);
+        }
 
-        events.pop_back();
-        if (events.size() % 2 != 0) { // delete "erase" operation
-            long long prev_tm = events.back();
-            tree->remove(prev_tm, tm - 1, it->second);
-            tree->add(prev_tm, std::numeric_limits<long long>::max(), it->second);
-        } else
-            tree->remove(tm, std::numeric_limits<long long>::max(), it->second);
-        operations.erase(it);
+        events.erase(event_it);
+        if (events.empty())
+            sequences.erase(seq_it);
+        operations.erase(tm);
+        log_update(journal_op::remove, T(), tm);
         return true;
     }
 
     T lower_bound(const T& x, long long tm = std::numeric_limits<long long>::max()) {
-        return tree->lower_bound(tm, x);
+        if (!tree || tm < first_time)
+            return std::numeric_limits<T>::max();
+        if (cascaded)
+            return tree->cascaded_bound(std::min(tm, last_time), x, false, first_time, last_time);
+        return tree->lower_bound(std::min(tm, last_time), x, first_time, last_time);
     }
 
     T upper_bound(const T& x, long long tm = std::numeric_limits<long long>::max()) {
-        return tree->upper_bound(tm, x);
+        if (!tree || tm < first_time)
+            return std::numeric_limits<T>::max();
+        if (cascaded)
+            return tree->cascaded_bound(std::min(tm, last_time), x, true, first_time, last_time);
+        return tree->upper_bound(std::min(tm, last_time), x, first_time, last_time);
     }
 
     bool find(const T& x, long long tm = std::numeric_limits<long long>::max()) {
         return lower_bound(x, tm) == x;
     }
 
+    /// lower_bound, upper_bound and find at each of the given times. Sorted times are answered
+    /// in one descent of the segment tree that splits them among the children, so the top
+    /// levels are searched once for all of them; unsorted ones are answered one by one.
+    std::vector<T> lower_bound_at(const T& x, const std::vector<long long>& times) {
+        return bound_at(x, times, false);
+    }
+
+    std::vector<T> upper_bound_at(const T& x, const std::vector<long long>& times) {
+        return bound_at(x, times, true);
+    }
+
+    std::vector<bool> find_at(const T& x, const std::vector<long long>& times) {
+        std::vector<T> bounds = bound_at(x, times, false);
+        std::vector<bool> ans(bounds.size());
+        for (size_t i = 0; i < bounds.size(); ++i)
+            ans[i] = (bounds[i] == x);
+        return ans;
+    }
+
+    /// Replaces the contents of the set with the given operations, in any order, and returns
+    /// how many of them were accepted. An operation at the time of an earlier one in ops is
+    /// ignored, the others are accepted as if inserted one by one in the order of their times.
+    /// Instead of a segment tree update per operation, the operations are sorted by time and
+    /// by element, each element's events give its intervals of presence and the segment tree
+    /// is built top-down from all of them at once, in O(n log n). The sorts and the subtrees
+    /// are split among up to threads threads.
+    size_t build_from(const std::vector<edit>& ops, unsigned threads = std::thread::hardware_concurrency()) {
+        struct event {
+            T x;
+            long long tm;
+            size_t order; // position in ops
+            bool ins;
+        };
+
+        clear_contents(); // recorded along with the operations
+        threads = std::max(threads, 1u);
+        std::vector<event> events;
+        events.reserve(ops.size());
+        for (size_t i = 0; i < ops.size(); ++i)
+            if (ops[i].tm >= first_time && ops[i].tm <= last_time)
+                events.push_back({ops[i].x, ops[i].tm, i, ops[i].kind == edit::insert});
+
+        // Only the first of the operations at each time counts.
+        parallel_sort(events.begin(), events.end(), [](const event& a, const event& b) {
+            return a.tm < b.tm || (a.tm == b.tm && a.order < b.order);
+        }, threads);
+        events.erase(std::unique(events.begin(), events.end(), [](const event& a, const event& b) {
+            return a.tm == b.tm;
+        }), events.end());
+
+        // The events of each element in time order alternate between insertions and erasures.
+        parallel_sort(events.begin(), events.end(), [](const event& a, const event& b) {
+            return a.x < b.x || (!(b.x < a.x) && a.tm < b.tm);
+        }, threads);
+        std::vector<interval> intervals;
+        size_t accepted = 0;
+        for (size_t first = 0, last; first < events.size(); first = last) {
+            T x = events[first].x; // a copy, since the accepted events are moved to the front
+            std::map<long long, bool> kept;
+            bool present = false;
+            for (last = first; last < events.size() && !(x < events[last].x); ++last) {
+                const event& e = events[last];
+                if (e.ins == present)
+                    continue;
+                if (e.ins)
+                    intervals.push_back({e.tm, last_time, x});
+                else
+                    intervals.back().r = e.tm - 1;
+                present = e.ins;
+                kept.emplace_hint(kept.end(), e.tm, e.ins);
+                events[accepted++] = e;
+            }
+            if (!kept.empty())
+                sequences.emplace_hint(sequences.end(), x, std::move(kept));
+        }
+        events.resize(accepted);
+
+        parallel_sort(events.begin(), events.end(), [](const event& a, const event& b) {
+            return a.tm < b.tm;
+        }, threads);
+        for (const event& e : events) // appends to the log
+            operations.insert(e.tm, e.x);
+        if (!intervals.empty()) {
+            tree = new segtree();
+            tree->build(std::move(intervals), first_time, last_time, threads);
+        }
+        if (journal) {
+            std::vector<journal_record<T>> update(1, {journal_op::clear, T(), 0});
+            update.reserve(accepted + 1);
+            for (const event& e : events)
+                update.push_back({e.ins ? journal_op::insert : journal_op::erase, e.x, e.tm});
+            journal->record(update.data(), update.size());
+        }
+        return accepted;
+    }
+
+    /// Builds the fractional cascading index in O(total size of the buckets), after which
+    /// lower_bound/upper_bound do one binary search instead of one per level. The index is
+    /// dropped by the next update, so build it once the set is frozen for querying.
+    void build_index() {
+        if (tree && !cascaded) {
+            tree->build_cascade();
+            cascaded = true;
+        }
+    }
+
 
     /*** Present-time queries ***/
     bool insert(const T& x) {
@@ -231,23 +806,152 @@ public:
     }
 
     void clear() {
-        operations.clear();
-        sequences.clear();
-        tree->destroy();
-        tree = new segtree();
+        clear_contents();
+        log_update(journal_op::clear, T(), 0);
     }
+
+
+    /*** Journal ***/
+    /// Hands every accepted update to journal from now on (see journal.h), nullptr detaches
+    /// it; build_from() is recorded as one update, a clear() and the accepted operations in
+    /// time order.
+    /// The journal stays with this set: it isn't copied, moved or swapped, and assignments,
+    /// swaps and load_snapshot() aren't recorded.
+    void attach_journal(retroactive_journal<T> *j) {
+        journal = j;
+    }
+
+    /// Applies the records of an update again, false if one of them is rejected.
+    bool replay(const std::vector<journal_record<T>>& update) {
+        for (const journal_record<T>& r : update) {
+            if (r.op == journal_op::clear)
+                clear();
+            else if (!(r.op == journal_op::insert ? insert(r.x, r.tm) :
+                       r.op == journal_op::erase ? erase(r.x, r.tm) :
+                       r.op == journal_op::remove && delete_operation(r.tm)))
+                return false;
+        }
+        return true;
+    }
+
+
+    /*** Snapshots ***/
+    /// Writes a snapshot (see snapshot.h) of the set, whose elements have to be trivially
+    /// copyable: the time domain (bounds), the operations in time order (times, values,
+    /// inserted) and the image of the segment tree, its nodes in pre-order (see snapshot_node)
+    /// and the elements of their buckets (items), along with the position of the journal.
+    /// Snapshots don't depend on the bucket policy.
+    /// retroactive_set_view queries such a file in place.
+    bool save_snapshot(const std::string& path) const {
+        std::vector<long long> bounds = {first_time, last_time}, times;
+        std::vector<T> values, items;
+        std::vector<uint8_t> inserted;
+        std::vector<std::pair<long long, std::pair<const T*, bool>>> order; // time -> (element, is insert operation)
+        for (auto it = sequences.begin(); it != sequences.end(); ++it)
+            for (auto event = it->second.begin(); event != it->second.end(); ++event)
+                order.push_back({event->first, {&it->first, event->second}});
+        std::sort(order.begin(), order.end(), [](const std::pair<long long, std::pair<const T*, bool>>& a,
+                                                 const std::pair<long long, std::pair<const T*, bool>>& b) {
+            return a.first < b.first;
+        });
+        for (const std::pair<long long, std::pair<const T*, bool>>& op : order) {
+            times.push_back(op.first);
+            values.push_back(*op.second.first);
+            inserted.push_back(op.second.second);
+        }
+        std::vector<snapshot_node> nodes;
+        if (tree)
+            tree->save(nodes, items);
+
+        snapshot_writer writer(snapshot_kind::set, sizeof(T), journal ? journal->position() : 0);
+        writer.add(bounds);
+        writer.add(times);
+        writer.add(values);
+        writer.add(inserted);
+        writer.add(nodes);
+        writer.add(items);
+        return writer.write(path);
+    }
+
+    /// Replaces the contents of the set with a snapshot: the segment tree is rebuilt from its
+    /// image, bucket by bucket, without splitting any interval. Returns false and leaves the
+    /// set as it was if the file can't be read or isn't a snapshot of a retroactive_set<T>.
+    bool load_snapshot(const std::string& path) {
+        snapshot_file file;
+        const long long *bounds, *times;
+        const T *values, *items;
+        const uint8_t *inserted;
+        const snapshot_node *nodes;
+        size_t bound_count, n, value_count, inserted_count, node_count, item_count;
+        if (!file.open(path, snapshot_kind::set, sizeof(T)) || !file.section(section_bounds, bounds, bound_count) ||
+                !file.section(section_times, times, n) || !file.section(section_values, values, value_count) ||
+                !file.section(section_inserted, inserted, inserted_count) ||
+                !file.section(section_nodes, nodes, node_count) || !file.section(section_items, items, item_count) ||
+                bound_count != 2 || bounds[0] > bounds[1] || value_count != n || inserted_count != n)
+            return false;
+        std::vector<bool> linked(node_count, false); // every node but the root has one parent after it
+        for (size_t i = 0; i < node_count; ++i) {
+            for (uint64_t child : {nodes[i].left, nodes[i].right})
+                if (child != 0) {
+                    if (child <= i || child >= node_count || linked[child])
+                        return false;
+                    linked[child] = true;
+                }
+            if (nodes[i].first > nodes[i].last || nodes[i].last > item_count)
+                return false;
+        }
+
+        retroactive_set<T, Bucket> loaded(bounds[0], bounds[1]);
+        for (size_t i = 0; i < n; ++i) {
+            if (times[i] < bounds[0] || times[i] > bounds[1] || (i > 0 && times[i] <= times[i - 1]))
+                return false;
+            std::map<long long, bool>& events = loaded.sequences[values[i]];
+            events.emplace_hint(events.end(), times[i], inserted[i] != 0);
+            loaded.operations.insert(times[i], values[i]);
+        }
+        if (node_count > 0) {
+            loaded.tree = new segtree();
+            loaded.tree->load(nodes, 0, items);
+        }
+#ifdef RETROACTIVE_STATS
+        loaded.counters = counters;
+#endif
+        swap(loaded);
+        return true;
+    }
+
+#ifdef RETROACTIVE_STATS
+    /// Shape of the segment tree, whose bytes include the buckets and the cascades. There are
+    /// no treaps, so splits, merges and rollbacks stay 0.
+    retroactive_stats stats() const {
+        retroactive_stats s;
+        s.counters = counters;
+        if (tree)
+            tree->measure(1, s);
+        s.operations_bytes = operations.bytes();
+        for (auto it = sequences.begin(); it != sequences.end(); ++it)
+            s.sequences_bytes += retroactive_stats::tree_node_bytes<std::pair<const T, std::map<long long, bool>>>() +
+                                 it->second.size() * retroactive_stats::tree_node_bytes<std::pair<const long long, bool>>();
+        return s;
+    }
+#endif
 };
 
 
 /*** Friend operators implementation ***/
-template<class T>
-inline bool operator==(const retroactive_set<T>& x, const retroactive_set<T> &y) {
+template<class T, class Bucket>
+inline bool operator==(const retroactive_set<T, Bucket>& x, const retroactive_set<T, Bucket> &y) {
     return x.operations == y.operations;
 }
 
-template<class T>
-inline bool operator!=(const retroactive_set<T>& x, const retroactive_set<T> &y) {
+template<class T, class Bucket>
+inline bool operator!=(const retroactive_set<T, Bucket>& x, const retroactive_set<T, Bucket> &y) {
     return !(x == y);
 }
 
+template<class T, class Bucket>
+inline void swap(retroactive_set<T, Bucket>& x, retroactive_set<T, Bucket>& y) noexcept {
+    x.swap(y);
+}
+
 #endif // RETROACTIVE_SET_H_INCLUDED
@@ -0,0 +1,106 @@
+#ifndef RETROACTIVE_SET_VIEW_H_INCLUDED
+#define RETROACTIVE_SET_VIEW_H_INCLUDED
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+#include "../common/snapshot.h"
+#include "retroactive_set.h"
+
+/// Read-only retroactive_set answering queries straight from a snapshot mapped into memory
+/// (see retroactive_set::save_snapshot). Opening it is O(1) whatever the size of the snapshot,
+/// and a query walks the image of the segment tree with a binary search in the bucket of each
+/// node on the path, like retroactive_set without the cascading index. Only the pages the
+/// queries touch are ever read. A broken file can give wrong answers, but never reads outside
+/// of it.
+template<typename T>
+class retroactive_set_view {
+
+private:
+    typedef retroactive_set<T> container;
+    typedef typename container::snapshot_node node;
+
+    snapshot_file file;
+    long long first_time, last_time;
+    const node *nodes;
+    const T *items;
+    size_t node_count, item_count;
+
+    T bound(const T& x, long long tm, bool strict) const {
+        T ans = std::numeric_limits<T>::max(); // we assume for now that the type T is numeric
+        if (node_count == 0 || tm < first_time)
+            return ans;
+        tm = std::min(tm, last_time);
+        long long tl = first_time, tr = last_time;
+        for (size_t i = 0; ; ) {
+            const node& n = nodes[i];
+            if (n.first > n.last || n.last > item_count)
+                break;
+            const T *first = items + n.first, *last = items + n.last;
+            const T *found = (strict ? std::upper_bound(first, last, x) : std::lower_bound(first, last, x));
+            if (found != last)
+                ans = std::min(ans, *found);
+
+            long long tmid = (tl >> 1) + (tr >> 1) + (tl & tr & 1LL); // overflow-safe calculation of mean value
+            uint64_t next;
+            if (tm <= tmid) {
+                next = n.left;
+                tr = tmid;
+            } else {
+                next = n.right;
+                tl = tmid + 1;
+            }
+            if (next <= i || next >= node_count) // no such child, children always come after their parent
+                break;
+            i = next;
+        }
+        return ans;
+    }
+
+public:
+    retroactive_set_view<T>() : file(), first_time(0), last_time(0), nodes(nullptr), items(nullptr), node_count(0),
+            item_count(0) { }
+
+    bool open(const std::string& path) {
+        close();
+        const long long *bounds;
+        size_t bound_count;
+        if (!file.open(path, snapshot_kind::set, sizeof(T)) ||
+                !file.section(container::section_bounds, bounds, bound_count) ||
+                !file.section(container::section_nodes, nodes, node_count) ||
+                !file.section(container::section_items, items, item_count) || bound_count != 2) {
+            close();
+            return false;
+        }
+        first_time = bounds[0];
+        last_time = bounds[1];
+        return true;
+    }
+
+    void close() {
+        file.close();
+        nodes = nullptr;
+        items = nullptr;
+        node_count = item_count = 0;
+    }
+
+    inline bool is_open() const {
+        return file.is_open();
+    }
+
+    T lower_bound(const T& x, long long tm = std::numeric_limits<long long>::max()) const {
+        return bound(x, tm, false);
+    }
+
+    T upper_bound(const T& x, long long tm = std::numeric_limits<long long>::max()) const {
+        return bound(x, tm, true);
+    }
+
+    bool find(const T& x, long long tm = std::numeric_limits<long long>::max()) const {
+        return lower_bound(x, tm) == x;
+    }
+};
+
+#endif // RETROACTIVE_SET_VIEW_H_INCLUDED
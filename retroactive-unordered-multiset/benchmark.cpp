@@ -0,0 +1,114 @@
+#include <iostream>
+#include <limits>
+#include <map>
+#include <utility>
+
+#include "../common/benchmark.h"
+#include "concurrent_retroactive_unordered_multiset.h"
+#include "retroactive_unordered_multiset.h"
+
+using namespace std;
+
+/// Updates are insertions (add) or erasures of one copy of the value. Queries are finds at
+/// their time.
+struct multiset_subject {
+    retroactive_unordered_multiset<int> s;
+
+    static const char *name() {
+        return "retroactive";
+    }
+
+    long long apply(const workload_op& op) {
+        switch (op.kind) {
+        case workload_op::update:
+            return op.add ? s.insert(op.value, op.tm) : s.erase(op.value, op.tm);
+        case workload_op::remove:
+            return s.delete_operation(op.tm);
+        default:
+            return s.find(op.value, op.tm);
+        }
+    }
+};
+
+/// The same operations through the sharded variant, from a single thread: the cost of its
+/// locks and of the time shards.
+struct sharded_multiset_subject {
+    concurrent_retroactive_unordered_multiset<int> s;
+
+    static const char *name() {
+        return "sharded";
+    }
+
+    long long apply(const workload_op& op) {
+        switch (op.kind) {
+        case workload_op::update:
+            return op.add ? s.insert(op.value, op.tm) : s.erase(op.value, op.tm);
+        case workload_op::remove:
+            return s.delete_operation(op.tm);
+        default:
+            return s.find(op.value, op.tm);
+        }
+    }
+};
+
+/// Keeps the log of operations only and replays it for every query, and for every update to
+/// check that the number of copies of the element never goes negative.
+struct multiset_baseline {
+    map<long long, pair<int, bool>> log; // time -> (element, is insert operation)
+
+    static const char *name() {
+        return "naive replay";
+    }
+
+    bool valid(int x) const {
+        long long count = 0;
+        for (auto it = log.begin(); it != log.end(); ++it)
+            if (it->second.first == x && (count += (it->second.second ? 1 : -1)) < 0)
+                return false;
+        return true;
+    }
+
+    long long apply(const workload_op& op) {
+        switch (op.kind) {
+        case workload_op::update: {
+            auto inserted = log.emplace(op.tm, make_pair(op.value, op.add));
+            if (!inserted.second)
+                return false;
+            if (!valid(op.value)) {
+                log.erase(inserted.first);
+                return false;
+            }
+            return true;
+        }
+        case workload_op::remove: {
+            auto it = log.find(op.tm);
+            if (it == log.end())
+                return false;
+            pair<int, bool> removed = it->second;
+            log.erase(it);
+            if (!valid(removed.first)) {
+                log.emplace(op.tm, removed);
+                return false;
+            }
+            return true;
+        }
+        default: {
+            long long count = 0;
+            for (auto it = log.begin(); it != log.end() && it->first <= op.tm; ++it)
+                if (it->second.first == op.value)
+                    count += (it->second.second ? 1 : -1);
+            return count > 0;
+        }
+        }
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    benchmark_options options;
+    if (!parse_benchmark_options(argc, argv, options)) {
+        cerr << "usage: " << argv[0] << " [--ops N,...] [--mix NAME,...] [--seed S] [--keys K] [--baseline-limit N]" << endl;
+        return 2;
+    }
+    return benchmark_suite<multiset_baseline, multiset_subject, sharded_multiset_subject>::run(options);
+}
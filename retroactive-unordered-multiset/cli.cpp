@@ -1,69 +1,125 @@
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 
+#include "../common/cli_io.h"
 #include "retroactive_unordered_multiset.h"
 
 using namespace std;
 
-void run(istream& cin, bool allow_files = false) {
+/// Operation codes of the binary log (see binary_reader): the index of each command.
+const vector<string> binary_operations = {
+    "finish", "insert", "insert_retro", "erase", "erase_retro", "delete_operation", "find",
+    "find_retro", "run", "clear", "stats", "transaction"
+};
+
+template<typename Input>
+void run(Input& cin, bool allow_files = false) {
     retroactive_unordered_multiset<string> rd;
 
     string operation;
     string x;
     long long tm;
-    while ((cin >> operation) && operation != "finish") {
+    while (cin.read_operation(operation) && operation != "finish") {
         if (operation == "insert") {
             cin >> x;
             bool success = rd.insert(x);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "insert_retro") {
             cin >> x >> tm;
             bool success = rd.insert(x, tm);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "erase") {
             cin >> x;
             bool success = rd.erase(x);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "erase_retro") {
             cin >> x >> tm;
             bool success = rd.erase(x, tm);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "delete_operation") {
             cin >> tm;
             bool success = rd.delete_operation(tm);
-            cout << (success ? "ok" : "not ok") << endl;
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "find") {
             cin >> x;
             bool success = rd.find(x);
-            cout << (success ? "found" : "not found") << endl;
+            cout << (success ? "found" : "not found") << '\n';
 
         } else if (operation == "find_retro") {
             cin >> x >> tm;
             bool success = rd.find(x, tm);
-            cout << (success ? "found" : "not found") << endl;
+            cout << (success ? "found" : "not found") << '\n';
+
+        } else if (operation == "transaction") {
+            // transaction n, then n of insert_retro, erase_retro and delete_operation with their arguments;
+            // an unknown edit rejects the transaction and ends the input being read
+            long long n;
+            cin >> n;
+            vector<retroactive_unordered_multiset<string>::edit> edits;
+            string edit_operation;
+            for (long long i = 0; i < n && cin.read_operation(edit_operation); ++i) {
+                retroactive_unordered_multiset<string>::edit e{retroactive_unordered_multiset<string>::edit::remove, "", 0};
+                if (edit_operation == "insert_retro" || edit_operation == "erase_retro") {
+                    cin >> e.x >> e.tm;
+                    e.kind = (edit_operation == "insert_retro" ? retroactive_unordered_multiset<string>::edit::insert
+                                                               : retroactive_unordered_multiset<string>::edit::erase);
+                } else if (edit_operation == "delete_operation")
+                    cin >> e.tm;
+                else { // its arguments are unknown, so the rest of the input can't be read in step
+                    cout << "not ok" << '\n';
+                    return;
+                }
+                edits.push_back(e);
+            }
+            bool success = rd.apply_transaction(edits);
+            cout << (success ? "ok" : "not ok") << '\n';
 
         } else if (operation == "run" && allow_files) {
             string filename;
             cin >> filename;
             ifstream fin(filename);
-            run(fin);
+            Input file_in = cin.nested(fin);
+            run(file_in);
 
         } else if (operation == "clear") {
             rd.clear();
 
+        } else if (operation == "stats") {
+#ifdef RETROACTIVE_STATS
+            rd.stats().write(cout, "retroactive_unordered_multiset");
+#else
+            cout << "not ok" << '\n'; // built without RETROACTIVE_STATS
+#endif
+
         }
     }
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    run(cin, true);
+    // --batch: text commands parsed by hand, output not flushed after each command
+    // --binary: binary operation log (see binary_reader)
+    cli_mode mode = parse_cli_mode(argc, argv);
+    if (mode != cli_mode::interactive)
+        setup_batch_output();
+
+    if (mode == cli_mode::binary) {
+        binary_reader in(cin, binary_operations);
+        run(in, true);
+    } else if (mode == cli_mode::batch) {
+        text_reader in(cin);
+        run(in, true);
+    } else {
+        stream_reader in(cin);
+        run(in, true);
+    }
 
     return 0;
 }
@@ -0,0 +1,211 @@
+#ifndef CONCURRENT_RETROACTIVE_UNORDERED_MULTISET_H_INCLUDED
+#define CONCURRENT_RETROACTIVE_UNORDERED_MULTISET_H_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+
+#include "../common/operation_log.h"
+#include "../common/retroactive_stats.h"
+#include "retroactive_unordered_multiset.h"
+
+/// retroactive_unordered_multiset for concurrent writers (build with -pthread). The elements
+/// are split among key shards by their hash, each one holding the histories of its elements
+/// with its own lock, so updates of elements of different shards run in parallel. Since there
+/// is at most one operation at each time over all the elements, the log of the operations is
+/// split among time shards (by the hash of the time) instead, which also gives the key shard
+/// of the operation to delete_operation. A time shard is always locked before a key shard, so
+/// there are no deadlocks, and both are held only for the O(log n) update itself.
+///
+/// Unlike in retroactive_unordered_multiset, the present time comes from an atomic clock
+/// which only moves forward: it is past every accepted operation, but the times of deleted
+/// operations at the present aren't reused.
+template<typename T, typename Hash = std::hash<T>>
+class concurrent_retroactive_unordered_multiset {
+
+private:
+    /// Both kinds of shards are padded to keep the locks of neighbours off each other's cache
+    /// lines; alignas wouldn't be honoured by new[] before C++17.
+    struct key_shard {
+        std::mutex lock;
+        retroactive_unordered_multiset<T> elements; // its own log stays empty
+        char padding[64];
+    };
+
+    struct time_shard {
+        std::mutex lock;
+        operation_log<T> operations;
+#ifdef RETROACTIVE_STATS
+        retroactive_counters counters;
+#endif
+        char padding[64];
+    };
+
+    size_t shard_count;
+    std::unique_ptr<key_shard[]> keys;
+    std::unique_ptr<time_shard[]> times;
+    std::atomic<long long> clock; // the present time: after all the accepted operations
+    Hash hash;
+
+    inline key_shard& key_of(const T& x) const {
+        return keys[hash(x) % shard_count];
+    }
+
+    inline time_shard& time_of(long long tm) const {
+        return times[static_cast<unsigned long long>(tm) % shard_count];
+    }
+
+    inline void advance_clock(long long tm) {
+        if (tm == std::numeric_limits<long long>::max())
+            return;
+        long long now = clock.load();
+        while (now <= tm && !clock.compare_exchange_weak(now, tm + 1))
+            ;
+    }
+
+    /// The clock moves past tm before the operation shows up in its key shard, so that a
+    /// concurrent operation at the present either sees it move or is over before it is there.
+    bool add_operation(const T& x, long long tm, bool ins) {
+        time_shard& owner = time_of(tm);
+        std::lock_guard<std::mutex> time_guard(owner.lock);
+        RETROACTIVE_COUNT(owner.counters.updates);
+        if (owner.operations.contains(tm))
+            return false;
+
+        advance_clock(tm);
+        key_shard& shard = key_of(x);
+        {
+            std::lock_guard<std::mutex> key_guard(shard.lock);
+            if (!shard.elements.add_to_history(x, tm, ins))
+                return false;
+        }
+        owner.operations.insert(tm, x);
+        return true;
+    }
+
+    /// Operations at the present take the time on the clock, and only keep it if the clock
+    /// hasn't moved by the end of the update, while the key shard is still locked, so no
+    /// operation accepted before it comes later. Otherwise the update is undone and retried.
+    bool add_present_operation(const T& x, bool ins) {
+        while (true) {
+            long long tm = clock.load();
+            time_shard& owner = time_of(tm);
+            std::lock_guard<std::mutex> time_guard(owner.lock);
+            RETROACTIVE_COUNT(owner.counters.updates);
+            if (owner.operations.contains(tm)) {
+                advance_clock(tm);
+                continue;
+            }
+
+            key_shard& shard = key_of(x);
+            std::lock_guard<std::mutex> key_guard(shard.lock);
+            bool added = shard.elements.add_to_history(x, tm, ins);
+            long long expected = tm;
+            if (added ? !clock.compare_exchange_strong(expected, tm + 1) : clock.load() != tm) {
+                if (added)
+                    shard.elements.remove_from_history(x, tm); // fine, it was valid without it
+                continue;
+            }
+            if (added)
+                owner.operations.insert(tm, x);
+            return added;
+        }
+    }
+
+public:
+    /// shards is the number of key shards and of time shards; a few times the number of
+    /// writer threads keeps collisions between them rare.
+    explicit concurrent_retroactive_unordered_multiset<T, Hash>(size_t shards = 64, const Hash& hash = Hash()) :
+            shard_count(std::max<size_t>(shards, 1)), keys(new key_shard[shard_count]),
+            times(new time_shard[shard_count]), clock(0), hash(hash) { }
+
+    concurrent_retroactive_unordered_multiset<T, Hash>(const concurrent_retroactive_unordered_multiset<T, Hash>&) = delete;
+    concurrent_retroactive_unordered_multiset<T, Hash>& operator=(const concurrent_retroactive_unordered_multiset<T, Hash>&) = delete;
+
+
+    /*** Retroactive updates and queries ***/
+    /// All of them are safe to call concurrently.
+    bool insert(const T& x, long long tm) {
+        return add_operation(x, tm, true);
+    }
+
+    bool erase(const T& x, long long tm) {
+        return add_operation(x, tm, false);
+    }
+
+    bool delete_operation(long long tm) {
+        time_shard& owner = time_of(tm);
+        std::lock_guard<std::mutex> time_guard(owner.lock);
+        RETROACTIVE_COUNT(owner.counters.updates);
+        const T *x = owner.operations.find(tm);
+        if (!x)
+            return false;
+
+        key_shard& shard = key_of(*x);
+        {
+            std::lock_guard<std::mutex> key_guard(shard.lock);
+            if (!shard.elements.remove_from_history(*x, tm))
+                return false;
+        }
+        owner.operations.erase(tm);
+        return true;
+    }
+
+    bool find(const T& x, long long tm = std::numeric_limits<long long>::max()) {
+        key_shard& shard = key_of(x);
+        std::lock_guard<std::mutex> key_guard(shard.lock);
+        return shard.elements.find(x, tm);
+    }
+
+
+    /*** Present-time updates ***/
+    bool insert(const T& x) {
+        return add_present_operation(x, true);
+    }
+
+    bool erase(const T& x) {
+        return add_present_operation(x, false);
+    }
+
+    /// Not safe to call concurrently with anything else.
+    void clear() {
+        for (size_t i = 0; i < shard_count; ++i) {
+            keys[i].elements.clear();
+            times[i].operations.clear();
+        }
+        clock.store(0);
+    }
+
+#ifdef RETROACTIVE_STATS
+    /// Sum of the stats of the shards: the time shards count the updates and hold the log.
+    retroactive_stats stats() {
+        retroactive_stats s;
+        for (size_t i = 0; i < shard_count; ++i) {
+            retroactive_stats part;
+            {
+                std::lock_guard<std::mutex> key_guard(keys[i].lock);
+                part = keys[i].elements.stats();
+            }
+            std::lock_guard<std::mutex> time_guard(times[i].lock);
+            s.counters.updates += times[i].counters.updates;
+            s.counters.rollbacks += part.counters.rollbacks;
+            s.counters.splits += part.counters.splits;
+            s.counters.merges += part.counters.merges;
+            s.nodes += part.nodes;
+            s.max_depth = std::max(s.max_depth, part.max_depth);
+            s.total_depth += part.total_depth;
+            s.operations_bytes += part.operations_bytes;
+            s.sequences_bytes += part.sequences_bytes;
+            s.tree_bytes += part.tree_bytes;
+            s.operations_bytes += times[i].operations.bytes();
+        }
+        return s;
+    }
+#endif
+};
+
+#endif // CONCURRENT_RETROACTIVE_UNORDERED_MULTISET_H_INCLUDED
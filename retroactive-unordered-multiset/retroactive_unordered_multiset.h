@@ -1,17 +1,29 @@
 #ifndef RETROACTIVE_UNORDERED_MULTISET_H_INCLUDED
 #define RETROACTIVE_UNORDERED_MULTISET_H_INCLUDED
 
+#include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <limits>
 #include <map>
+#include <memory>
+#include <random>
 #include <set>
+#include <string>
 #include <utility>
 #include <vector>
 
+#include "../common/journal.h"
+#include "../common/operation_log.h"
+#include "../common/retroactive_stats.h"
+#include "../common/snapshot.h"
+
 template<typename T>
 class retroactive_unordered_multiset {
 
 private:
+    struct node_pool;
+
     struct treap {
         treap *L, *R;
         int prior;
@@ -20,8 +32,7 @@ private:
 
         treap() { }
 
-        treap(long long cur_time, bool inserted) : L(nullptr), R(nullptr),
-                prior(((rand() & 0x7FFF) << 15) | (rand() & 0x7FFF)), ins(inserted),
+        treap(long long cur_time, bool inserted, int priority) : L(nullptr), R(nullptr), prior(priority), ins(inserted),
                 tm(cur_time), balance(ins ? 1 : -1), min_pref(balance), max_suff(balance) { }
 
         static inline long long get_balance(treap *t) { return t ? t->balance : 0; }
@@ -40,72 +51,143 @@ private:
             }
         }
 
-        static void merge(treap *& t, treap *l, treap *r) {
+        static void merge(treap *& t, treap *l, treap *r, node_pool& nodes) {
+            RETROACTIVE_COUNT(nodes.counters.merges);
             if (!l)
                 t = r;
             else if (!r)
                 t = l;
             else if (l->prior > r->prior) {
-                treap::merge(l->R, l->R, r);
+                treap::merge(l->R, l->R, r, nodes);
                 t = l;
             } else {
-                treap::merge(r->L, l, r->L);
+                treap::merge(r->L, l, r->L, nodes);
                 t = r;
             }
             treap::recalc(t);
         }
 
-        static void split(treap *t, treap *& l, treap *& r, long long x) { // <=x -> L,   >x -> R
+        static void split(treap *t, treap *& l, treap *& r, long long x, node_pool& nodes) { // <=x -> L,   >x -> R
+            RETROACTIVE_COUNT(nodes.counters.splits);
             if (!t) {
                 l = r = nullptr;
                 return;
             }
 
             if (t->tm <= x) {
-                treap::split(t->R, t->R, r, x);
+                treap::split(t->R, t->R, r, x, nodes);
                 l = t;
             } else {
-                treap::split(t->L, l, t->L, x);
+                treap::split(t->L, l, t->L, x, nodes);
                 r = t;
             }
             treap::recalc(l);
             treap::recalc(r);
         }
 
-        static void destroy(treap *t) {
-            if (t) {
-                treap::destroy(t->L);
-                treap::destroy(t->R);
-                delete t;
+        static treap *copy(treap *src, node_pool& nodes) {
+            if (!src)
+                return nullptr;
+            treap *dest = nodes.allocate();
+            *dest = *src;
+            dest->L = treap::copy(src->L, nodes);
+            dest->R = treap::copy(src->R, nodes);
+            return dest;
+        }
+
+        static void insert(treap *& t, long long tm, bool ins, node_pool& nodes) {
+            treap *t1, *t2;
+            treap::split(t, t1, t2, tm, nodes);
+            treap::merge(t1, t1, nodes.create(tm, ins), nodes);
+            treap::merge(t, t1, t2, nodes);
+        }
+
+        static const treap *find(const treap *t, long long tm) {
+            while (t && t->tm != tm)
+                t = (tm < t->tm ? t->L : t->R);
+            return t;
+        }
+
+        static void erase(treap *& t, long long tm, node_pool& nodes) {
+            treap *t1, *t2, *t3;
+            treap::split(t, t1, t3, tm, nodes);
+            treap::split(t1, t1, t2, tm - 1, nodes);
+            if (t2)
+                nodes.deallocate(t2);
+            treap::merge(t, t1, t3, nodes);
+        }
+
+        /// max_suff and balance of the operations with time <= tm for every tm of the sorted range
+        /// [first, last), without splitting the treap: the times are split among the children
+        /// instead, so each node shared by their paths is visited once. max_suff is
+        /// LLONG_MIN if there are no such operations.
+        static void prefix_max_suff(const treap *t, const long long *first, const long long *last,
+                                    long long *max_suff, long long *balance) {
+            if (!t) {
+                std::fill(max_suff, max_suff + (last - first), std::numeric_limits<long long>::min());
+                std::fill(balance, balance + (last - first), 0LL);
+                return;
+            }
+            size_t before = std::lower_bound(first, last, t->tm) - first;
+            if (before > 0)
+                treap::prefix_max_suff(t->L, first, first + before, max_suff, balance);
+            if (first + before == last)
+                return;
+
+            treap::prefix_max_suff(t->R, first + before, last, max_suff + before, balance + before);
+            long long left_max_suff = std::max(0LL, t->L ? t->L->max_suff : 0LL);
+            for (size_t i = before; i < static_cast<size_t>(last - first); ++i) { // the node and all of t->L join
+                max_suff[i] = std::max(max_suff[i], balance[i] + (t->ins ? 1 : -1) + left_max_suff);
+                balance[i] += (t->ins ? 1 : -1) + treap::get_balance(t->L);
             }
         }
 
-        static void copy(treap *dest, treap *src) {
-            *dest = *src;
-            if (src->L) {
-                dest->L = new treap();
-                treap::copy(dest->L, src->L);
+#ifdef RETROACTIVE_STATS
+        static void measure(const treap *t, size_t depth, retroactive_stats& s) {
+            if (t) {
+                s.add_node(depth);
+                treap::measure(t->L, depth + 1, s);
+                treap::measure(t->R, depth + 1, s);
             }
-            if (src->R) {
-                dest->R = new treap();
-                treap::copy(dest->R, src->R);
+        }
+#endif
+
+        /// Links nodes sorted by time into a treap in O(n): each node takes the nodes of lower
+        /// priority at the end of the right spine as its left subtree. Then the aggregates are
+        /// computed bottom-up.
+        static treap *build(const std::vector<treap*>& sorted) {
+            std::vector<treap*> spine;
+            for (treap *t : sorted) {
+                treap *last = nullptr;
+                while (!spine.empty() && spine.back()->prior < t->prior) {
+                    last = spine.back();
+                    spine.pop_back();
+                }
+                t->L = last;
+                if (!spine.empty())
+                    spine.back()->R = t;
+                spine.push_back(t);
             }
+            if (spine.empty())
+                return nullptr;
+            treap::recalc_all(spine.front());
+            return spine.front();
         }
 
-        static void insert(treap *& t, long long tm, bool ins) {
-            treap *t1, *t2;
-            treap::split(t, t1, t2, tm);
-            treap::merge(t1, t1, new treap(tm, ins));
-            treap::merge(t, t1, t2);
+        static void recalc_all(treap *t) {
+            if (t) {
+                treap::recalc_all(t->L);
+                treap::recalc_all(t->R);
+                treap::recalc(t);
+            }
         }
 
-        static void erase(treap *& t, long long tm) {
-            treap *t1, *t2, *t3;
-            treap::split(t, t1, t3, tm);
-            treap::split(t1, t1, t2, tm - 1);
-            if (t2)
-                delete t2;
-            treap::merge(t, t1, t3);
+        static void fill_vector(const treap *t, std::vector<const treap*>& v) {
+            if (t) {
+                treap::fill_vector(t->L, v);
+                v.push_back(t);
+                treap::fill_vector(t->R, v);
+            }
         }
 
         static void fill_ins_vector(treap *t, std::vector<bool> & v) { // necessary for sequences comparisons
@@ -117,18 +199,164 @@ private:
         }
     };
 
-    std::map<long long, T> operations;
+    /// Slab allocator for treap nodes: nodes are carved from fixed-size blocks and
+    /// released nodes are chained into a free list (through L) for reuse. clear()
+    /// forgets every node at once and keeps the blocks for the next nodes. The priorities
+    /// come from a generator of the pool rather than rand(), whose shared state would
+    /// serialize the shards of concurrent_retroactive_unordered_multiset.
+    struct node_pool {
+        static const size_t block_size = 1024;
+
+        std::vector<std::unique_ptr<treap[]>> blocks;
+        size_t next_block;
+        treap *cursor, *cursor_end;
+        treap *free_list;
+        std::minstd_rand priorities;
+#ifdef RETROACTIVE_STATS
+        retroactive_counters counters;
+#endif
+
+        node_pool() : blocks(), next_block(0), cursor(nullptr), cursor_end(nullptr), free_list(nullptr), priorities() { }
+
+        node_pool(const node_pool&) = delete;
+        node_pool& operator=(const node_pool&) = delete;
+
+        node_pool(node_pool&& other) noexcept : node_pool() {
+            swap(other);
+        }
+
+        void swap(node_pool& other) noexcept { // the nodes keep their addresses
+            std::swap(blocks, other.blocks);
+            std::swap(next_block, other.next_block);
+            std::swap(cursor, other.cursor);
+            std::swap(cursor_end, other.cursor_end);
+            std::swap(free_list, other.free_list);
+            std::swap(priorities, other.priorities);
+#ifdef RETROACTIVE_STATS
+            std::swap(counters, other.counters);
+#endif
+        }
+
+        treap *allocate() {
+            if (free_list) {
+                treap *t = free_list;
+                free_list = t->L;
+                return t;
+            }
+            if (cursor == cursor_end) {
+                if (next_block == blocks.size())
+                    blocks.emplace_back(new treap[block_size]);
+                cursor = blocks[next_block++].get();
+                cursor_end = cursor + block_size;
+            }
+            return cursor++;
+        }
+
+        inline treap *create(long long tm, bool ins) {
+            treap *t = allocate();
+            *t = treap(tm, ins, static_cast<int>(priorities()));
+            return t;
+        }
+
+        inline void deallocate(treap *t) {
+            t->L = free_list;
+            free_list = t;
+        }
+
+        void clear() {
+            next_block = 0;
+            cursor = cursor_end = nullptr;
+            free_list = nullptr;
+        }
+    };
+
+    operation_log<T> operations;
     std::map<T, treap*> sequences;
+    node_pool nodes; // shared by the treaps of all the elements
+    retroactive_journal<T> *journal; // nullptr if none is attached
 
     inline long long get_last_time() {
-        return operations.empty() ? 0 : operations.rbegin()->first + 1;
+        return operations.next_time();
+    }
+
+    inline void log_update(journal_op op, const T& x, long long tm) {
+        if (journal) {
+            journal_record<T> update = {op, x, tm};
+            journal->record(&update, 1);
+        }
+    }
+
+    /// clear() without recording it, for the moved-from containers.
+    void clear_contents() {
+        operations.clear();
+        sequences.clear();
+        nodes.clear(); // releases every node at once instead of walking the trees
     }
 
     inline bool check_valid(const T& x) {
         return treap::get_min_pref(sequences[x]) >= 0;
     }
 
+    /// Drops the entry of x if it has no operations left.
+    inline void drop_if_empty(const T& x) {
+        auto seq_it = sequences.find(x);
+        if (seq_it != sequences.end() && !seq_it->second)
+            sequences.erase(seq_it);
+    }
+
+    /// Adds an operation of x at tm, a time the log doesn't have, to the history of x unless
+    /// it makes the history invalid. The log is up to the caller.
+    bool add_to_history(const T& x, long long tm, bool ins) {
+        treap::insert(sequences[x], tm, ins, nodes);
+        if (!ins && !check_valid(x)) { // an insertion keeps the history valid
+            RETROACTIVE_COUNT(nodes.counters.rollbacks);
+            auto seq_it = sequences.find(x);
+            treap::erase(seq_it->second, tm, nodes);
+            if (!seq_it->second)
+                sequences.erase(seq_it);
+            return false;
+        }
+        return true;
+    }
+
+    /// Removes the operation of x at tm from the history of x unless it makes the history
+    /// invalid. The log is up to the caller.
+    bool remove_from_history(const T& x, long long tm) {
+        auto seq_it = sequences.find(x);
+        treap::erase(seq_it->second, tm, nodes);
+        if (!check_valid(seq_it->first)) {
+            RETROACTIVE_COUNT(nodes.counters.rollbacks);
+            // It was insert operation, since erasing removal couldn't cause inconsistence
+            treap::insert(seq_it->second, tm, true, nodes);
+            return false;
+        }
+        if (!seq_it->second)
+            sequences.erase(seq_it);
+        return true;
+    }
+
+    /// Keeps the log of its shards itself, see add_to_history().
+    template<typename T1, typename H1>
+        friend class concurrent_retroactive_unordered_multiset;
+
 public:
+    typedef T value_type;
+
+    /// One edit of apply_transaction(): an insertion or an erasure of x at time tm, or the
+    /// deletion of the operation at time tm (x is ignored).
+    struct edit {
+        enum kind_t { insert, erase, remove };
+
+        kind_t kind;
+        T x;
+        long long tm;
+    };
+
+    /// Sections of the snapshots, see save_snapshot().
+    enum snapshot_section {
+        section_times, section_values, section_keys, section_offsets, section_history_times, section_counts
+    };
+
     /*** Friend operators ***/
     template<class T1>
         friend bool operator==(const retroactive_unordered_multiset<T1>& x, const retroactive_unordered_multiset<T1> &y);
@@ -137,90 +365,180 @@ public:
 
 
     /*** Constructors and destructor ***/
-    retroactive_unordered_multiset<T>() : operations(), sequences() { }
+    retroactive_unordered_multiset<T>() : operations(), sequences(), nodes(), journal(nullptr) { }
 
-    retroactive_unordered_multiset<T>(const retroactive_unordered_multiset<T>& other) {
-        operations = other.operations;
-        sequences = other.sequences;
-        for (auto it = sequences.begin(); it != sequences.end(); ++it) {
-            it->second = new treap();
-            treap::copy(it->second, other.sequences[it->first]);
-        }
+    retroactive_unordered_multiset<T>(const retroactive_unordered_multiset<T>& other) :
+            operations(other.operations), sequences(), nodes(), journal(nullptr) {
+        for (auto it = other.sequences.begin(); it != other.sequences.end(); ++it)
+            sequences.emplace_hint(sequences.end(), it->first, treap::copy(it->second, nodes));
     }
 
-    ~retroactive_unordered_multiset<T>() {
-        for (auto it = sequences.begin(); it != sequences.end(); ++it)
-            treap::destroy(it->second);
+    retroactive_unordered_multiset<T>(retroactive_unordered_multiset<T>&& other) noexcept :
+            operations(std::move(other.operations)), sequences(std::move(other.sequences)), nodes(std::move(other.nodes)),
+            journal(nullptr) {
+        other.clear_contents();
     }
 
+    ~retroactive_unordered_multiset<T>() { } // all the nodes are owned by the pool
+
 
     /*** Operators ***/
     retroactive_unordered_multiset<T>& operator=(const retroactive_unordered_multiset<T>& other) {
+        if (this == &other)
+            return *this;
         operations = other.operations;
-        for (auto it = sequences.begin(); it != sequences.end(); ++it)
-            treap::destroy(it->second);
-        sequences = other.sequences;
-        for (auto it = sequences.begin(); it != sequences.end(); ++it) {
-            it->second = new treap();
-            treap::copy(it->second, other.sequences[it->first]);
-        }
+        sequences.clear();
+        nodes.clear();
+        for (auto it = other.sequences.begin(); it != other.sequences.end(); ++it)
+            sequences.emplace_hint(sequences.end(), it->first, treap::copy(it->second, nodes));
+        return *this;
+    }
+
+    retroactive_unordered_multiset<T>& operator=(retroactive_unordered_multiset<T>&& other) noexcept {
+        if (this == &other)
+            return *this;
+        swap(other);
+        other.clear_contents();
         return *this;
     }
 
+    void swap(retroactive_unordered_multiset<T>& other) noexcept {
+        operations.swap(other.operations);
+        std::swap(sequences, other.sequences);
+        nodes.swap(other.nodes);
+    }
+
 
     /*** Retroactive updates and queries ***/
     bool insert(const T& x, long long tm) {
-        if (operations.find(tm) != operations.end())
+        RETROACTIVE_COUNT(nodes.counters.updates);
+        if (operations.contains(tm))
             return false;
 
-        treap::insert(sequences[x], tm, true);
-        operations[tm] = x;
+        add_to_history(x, tm, true);
+        operations.insert(tm, x);
+        log_update(journal_op::insert, x, tm);
         return true;
     }
 
     bool erase(const T& x, long long tm) {
-        if (operations.find(tm) != operations.end())
+        RETROACTIVE_COUNT(nodes.counters.updates);
+        if (operations.contains(tm) || !add_to_history(x, tm, false))
             return false;
 
-        treap::insert(sequences[x], tm, false);
-        if (!check_valid(x)) {
-            auto seq_it = sequences.find(x);
-            treap::erase(seq_it->second, tm);
-            if (!seq_it->second)
-                sequences.erase(seq_it);
-            return false;
-        }
-        operations[tm] = x;
+        operations.insert(tm, x);
+        log_update(journal_op::erase, x, tm);
         return true;
     }
 
     bool delete_operation(long long tm) {
-        auto it = operations.find(tm);
-        if (it == operations.end())
+        RETROACTIVE_COUNT(nodes.counters.updates);
+        const T *x = operations.find(tm);
+        if (!x || !remove_from_history(*x, tm))
             return false;
 
-        auto seq_it = sequences.find(it->second);
-        treap::erase(seq_it->second, tm);
-        if (!check_valid(seq_it->first)) {
-            // It was insert operation, since erasing removal couldn't cause inconsistence
-            treap::insert(seq_it->second, tm, true);
-            return false;
-        }
-        if (!seq_it->second)
-            sequences.erase(seq_it);
         operations.erase(tm);
+        log_update(journal_op::remove, T(), tm);
         return true;
     }
 
+    /// Applies all the edits or none of them. The history of every element has to be valid only
+    /// once all of them are applied, e.g. an erasure may come before the insertion it needs,
+    /// and it is checked once at the end for each of the touched elements. On failure the
+    /// applied edits are undone in reverse order. The journal gets the edits as one update.
+    bool apply_transaction(const std::vector<edit>& edits) {
+        struct applied {
+            T x;
+            long long tm;
+            bool ins;   // the kind of the operation
+            bool added; // added by the edit, otherwise deleted by it
+        };
+        std::vector<applied> done;
+        done.reserve(edits.size());
+
+        bool valid = true;
+        for (size_t i = 0; i < edits.size() && valid; ++i) {
+            const edit& e = edits[i];
+            RETROACTIVE_COUNT(nodes.counters.updates);
+            if (e.kind == edit::remove) {
+                const T *x = operations.find(e.tm);
+                valid = (x != nullptr);
+                if (valid) {
+                    treap *& seq = sequences.find(*x)->second;
+                    done.push_back({*x, e.tm, treap::find(seq, e.tm)->ins, false});
+                    treap::erase(seq, e.tm, nodes);
+                    operations.erase(e.tm);
+                }
+            } else {
+                valid = !operations.contains(e.tm);
+                if (valid) {
+                    treap::insert(sequences[e.x], e.tm, e.kind == edit::insert, nodes);
+                    operations.insert(e.tm, e.x);
+                    done.push_back({e.x, e.tm, e.kind == edit::insert, true});
+                }
+            }
+        }
+        for (size_t i = 0; i < done.size() && valid; ++i) {
+            auto seq_it = sequences.find(done[i].x);
+            valid = (seq_it == sequences.end() || treap::get_min_pref(seq_it->second) >= 0);
+        }
+
+        if (!valid) {
+            RETROACTIVE_COUNT(nodes.counters.rollbacks);
+            for (size_t i = done.size(); i-- > 0; ) {
+                const applied& a = done[i];
+                if (a.added) {
+                    treap::erase(sequences[a.x], a.tm, nodes);
+                    operations.erase(a.tm);
+                } else {
+                    treap::insert(sequences[a.x], a.tm, a.ins, nodes);
+                    operations.insert(a.tm, a.x);
+                }
+            }
+        }
+        for (const applied& a : done)
+            drop_if_empty(a.x);
+        if (valid && journal && !edits.empty()) {
+            std::vector<journal_record<T>> update;
+            update.reserve(edits.size());
+            for (const edit& e : edits)
+                update.push_back({e.kind == edit::insert ? journal_op::insert :
+                                  e.kind == edit::erase ? journal_op::erase : journal_op::remove,
+                                  e.kind == edit::remove ? T() : e.x, e.tm});
+            journal->record(update.data(), update.size());
+        }
+        return valid;
+    }
+
     bool find(const T& x, long long tm = std::numeric_limits<long long>::max()) {
         auto seq_it = sequences.find(x);
         if (seq_it == sequences.end())
             return false;
 
         treap *s1, *s2;
-        treap::split(seq_it->second, s1, s2, tm);
+        treap::split(seq_it->second, s1, s2, tm, nodes);
         bool ans = (treap::get_max_suff(s1) > 0);
-        treap::merge(seq_it->second, s1, s2);
+        treap::merge(seq_it->second, s1, s2, nodes);
+        return ans;
+    }
+
+    /// find at each of the given times. Sorted times are answered in one read-only descent of
+    /// the treap of x instead of a split and a merge per time; unsorted ones one by one.
+    std::vector<bool> find_at(const T& x, const std::vector<long long>& times) {
+        std::vector<bool> ans(times.size(), false);
+        auto seq_it = sequences.find(x);
+        if (seq_it == sequences.end() || times.empty())
+            return ans;
+        if (!std::is_sorted(times.begin(), times.end())) {
+            for (size_t i = 0; i < times.size(); ++i)
+                ans[i] = find(x, times[i]);
+            return ans;
+        }
+
+        std::vector<long long> max_suff(times.size()), balance(times.size());
+        treap::prefix_max_suff(seq_it->second, times.data(), times.data() + times.size(), max_suff.data(), balance.data());
+        for (size_t i = 0; i < times.size(); ++i)
+            ans[i] = (max_suff[i] > 0);
         return ans;
     }
 
@@ -235,11 +553,149 @@ public:
     }
 
     void clear() {
-        operations.clear();
+        clear_contents();
+        log_update(journal_op::clear, T(), 0);
+    }
+
+
+    /*** Journal ***/
+    /// Hands every accepted update to journal from now on (see journal.h), nullptr detaches
+    /// it. The journal stays with this multiset: it isn't copied, moved or swapped, and
+    /// assignments, swaps and load_snapshot() aren't recorded.
+    void attach_journal(retroactive_journal<T> *j) {
+        journal = j;
+    }
+
+    /// Applies the records of an update again, several of them as a transaction; false if
+    /// one of them is rejected.
+    bool replay(const std::vector<journal_record<T>>& update) {
+        if (update.size() > 1) {
+            std::vector<edit> edits;
+            edits.reserve(update.size());
+            for (const journal_record<T>& r : update) {
+                if (r.op != journal_op::insert && r.op != journal_op::erase && r.op != journal_op::remove)
+                    return false;
+                edits.push_back({r.op == journal_op::insert ? edit::insert :
+                                 r.op == journal_op::erase ? edit::erase : edit::remove, r.x, r.tm});
+            }
+            return apply_transaction(edits);
+        }
+        for (const journal_record<T>& r : update) {
+            if (r.op == journal_op::clear)
+                clear();
+            else if (!(r.op == journal_op::insert ? insert(r.x, r.tm) :
+                       r.op == journal_op::erase ? erase(r.x, r.tm) :
+                       r.op == journal_op::remove && delete_operation(r.tm)))
+                return false;
+        }
+        return true;
+    }
+
+
+    /*** Snapshots ***/
+    /// Writes a snapshot (see snapshot.h) of the multiset, whose elements have to be trivially
+    /// copyable: the operations in time order (times, values) and the histories of the
+    /// elements in increasing order of the elements (keys), the history of the i-th one being
+    /// [offsets[i], offsets[i + 1]) of history_times and counts, where counts holds the number
+    /// of copies of the element right after each operation, along with the position of the
+    /// journal. retroactive_unordered_multiset_view queries such a file in place.
+    bool save_snapshot(const std::string& path) const {
+        std::vector<T> keys, values;
+        std::vector<uint64_t> offsets(1, 0);
+        std::vector<long long> history_times, counts, times;
+        std::vector<std::pair<long long, size_t>> order; // time -> index of its element in keys
+        std::vector<const treap*> ops;
+        for (auto it = sequences.begin(); it != sequences.end(); ++it) {
+            ops.clear();
+            treap::fill_vector(it->second, ops);
+            long long count = 0;
+            for (const treap *op : ops) {
+                count += (op->ins ? 1 : -1);
+                history_times.push_back(op->tm);
+                counts.push_back(count);
+                order.push_back({op->tm, keys.size()});
+            }
+            keys.push_back(it->first);
+            offsets.push_back(history_times.size());
+        }
+        std::sort(order.begin(), order.end());
+        for (const std::pair<long long, size_t>& op : order) {
+            times.push_back(op.first);
+            values.push_back(keys[op.second]);
+        }
+
+        snapshot_writer writer(snapshot_kind::unordered_multiset, sizeof(T), journal ? journal->position() : 0);
+        writer.add(times);
+        writer.add(values);
+        writer.add(keys);
+        writer.add(offsets);
+        writer.add(history_times);
+        writer.add(counts);
+        return writer.write(path);
+    }
+
+    /// Replaces the contents of the multiset with a snapshot: the treap of each element is
+    /// linked from its sorted history at once, in O(n), then each operation of the log is
+    /// looked up in the history of its element, O(n log n). Returns false and leaves the
+    /// multiset as it was if the file can't be read or isn't a valid snapshot of a
+    /// retroactive_unordered_multiset<T>, e.g. if its log and histories don't match.
+    bool load_snapshot(const std::string& path) {
+        snapshot_file file;
+        const long long *times, *history_times, *counts;
+        const T *values, *keys;
+        const uint64_t *offsets;
+        size_t n, value_count, key_count, offset_count, history_count, count_count;
+        if (!file.open(path, snapshot_kind::unordered_multiset, sizeof(T)) ||
+                !file.section(section_times, times, n) || !file.section(section_values, values, value_count) ||
+                !file.section(section_keys, keys, key_count) || !file.section(section_offsets, offsets, offset_count) ||
+                !file.section(section_history_times, history_times, history_count) ||
+                !file.section(section_counts, counts, count_count) ||
+                value_count != n || history_count != n || count_count != n || offset_count != key_count + 1 ||
+                !snapshot_offsets_valid(offsets, offset_count, history_count))
+            return false;
+
+        retroactive_unordered_multiset<T> loaded;
+        std::vector<treap*> sorted;
+        for (size_t i = 0; i < key_count; ++i) {
+            if (offsets[i] == offsets[i + 1] || (i > 0 && !(keys[i - 1] < keys[i])))
+                return false;
+            sorted.clear();
+            long long count = 0;
+            for (uint64_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+                bool ins = (counts[j] == count + 1);
+                if ((!ins && counts[j] != count - 1) || counts[j] < 0 || (j > offsets[i] && history_times[j] <= history_times[j - 1]))
+                    return false; // not a valid history
+                count = counts[j];
+                sorted.push_back(loaded.nodes.create(history_times[j], ins));
+            }
+            loaded.sequences.emplace_hint(loaded.sequences.end(), keys[i], treap::build(sorted));
+        }
+        for (size_t i = 0; i < n; ++i)
+            if (!loaded.operations.insert(times[i], values[i]))
+                return false;
+        if (!snapshot_log_matches(times, values, n, keys, key_count, offsets, history_times))
+            return false;
+#ifdef RETROACTIVE_STATS
+        loaded.nodes.counters = nodes.counters;
+#endif
+        swap(loaded);
+        return true;
+    }
+
+#ifdef RETROACTIVE_STATS
+    /// Shape of the treaps of all the elements and bytes of the node pool. Splits and merges
+    /// include the ones done by find().
+    retroactive_stats stats() const {
+        retroactive_stats s;
+        s.counters = nodes.counters;
         for (auto it = sequences.begin(); it != sequences.end(); ++it)
-            treap::destroy(it->second);
-        sequences.clear();
+            treap::measure(it->second, 1, s);
+        s.operations_bytes = operations.bytes();
+        s.sequences_bytes = sequences.size() * retroactive_stats::tree_node_bytes<std::pair<const T, treap*>>();
+        s.tree_bytes = nodes.blocks.size() * node_pool::block_size * sizeof(treap);
+        return s;
     }
+#endif
 };
 
 
@@ -251,7 +707,10 @@ inline bool operator==(const retroactive_unordered_multiset<T>& x, const retroac
     for (auto it = x.sequences.begin(); it != x.sequences.end(); ++it) {
         std::vector<bool> vx, vy;
         retroactive_unordered_multiset<T>::treap::fill_ins_vector(it->second, vx);
-        retroactive_unordered_multiset<T>::treap::fill_ins_vector(y.sequences[it->first], vy);
+        auto y_it = y.sequences.find(it->first);
+        if (y_it == y.sequences.end())
+            return false;
+        retroactive_unordered_multiset<T>::treap::fill_ins_vector(y_it->second, vy);
         if (vx != vy)
             return false;
     }
@@ -263,4 +722,9 @@ inline bool operator!=(const retroactive_unordered_multiset<T>& x, const retroac
     return !(x == y);
 }
 
+template<class T>
+inline void swap(retroactive_unordered_multiset<T>& x, retroactive_unordered_multiset<T>& y) noexcept {
+    x.swap(y);
+}
+
 #endif // RETROACTIVE_UNORDERED_MULTISET_H_INCLUDED
@@ -0,0 +1,77 @@
+#ifndef RETROACTIVE_UNORDERED_MULTISET_VIEW_H_INCLUDED
+#define RETROACTIVE_UNORDERED_MULTISET_VIEW_H_INCLUDED
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+#include "../common/snapshot.h"
+#include "retroactive_unordered_multiset.h"
+
+/// Read-only retroactive_unordered_multiset answering queries straight from a snapshot mapped
+/// into memory (see retroactive_unordered_multiset::save_snapshot), like
+/// retroactive_unordered_set_view. The snapshot keeps the number of copies after every
+/// operation, so count() is as cheap as find().
+template<typename T>
+class retroactive_unordered_multiset_view {
+
+private:
+    typedef retroactive_unordered_multiset<T> container;
+
+    snapshot_file file;
+    const T *keys;
+    const uint64_t *offsets;
+    const long long *times;
+    const long long *counts;
+    size_t key_count, history_count;
+
+public:
+    retroactive_unordered_multiset_view<T>() : file(), keys(nullptr), offsets(nullptr), times(nullptr), counts(nullptr),
+            key_count(0), history_count(0) { }
+
+    bool open(const std::string& path) {
+        close();
+        size_t offset_count, count_count;
+        if (!file.open(path, snapshot_kind::unordered_multiset, sizeof(T)) ||
+                !file.section(container::section_keys, keys, key_count) ||
+                !file.section(container::section_offsets, offsets, offset_count) ||
+                !file.section(container::section_history_times, times, history_count) ||
+                !file.section(container::section_counts, counts, count_count) ||
+                offset_count != key_count + 1 || count_count != history_count) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        file.close();
+        keys = nullptr;
+        key_count = history_count = 0;
+    }
+
+    inline bool is_open() const {
+        return file.is_open();
+    }
+
+    /// Number of copies of x at time tm.
+    long long count(const T& x, long long tm = std::numeric_limits<long long>::max()) const {
+        const T *key = std::lower_bound(keys, keys + key_count, x);
+        if (key == keys + key_count || x < *key)
+            return 0;
+
+        size_t i = key - keys;
+        uint64_t first = offsets[i], last = offsets[i + 1];
+        if (first > last || last > history_count)
+            return 0;
+        const long long *it = std::upper_bound(times + first, times + last, tm);
+        return it != times + first ? counts[it - times - 1] : 0;
+    }
+
+    bool find(const T& x, long long tm = std::numeric_limits<long long>::max()) const {
+        return count(x, tm) > 0;
+    }
+};
+
+#endif // RETROACTIVE_UNORDERED_MULTISET_VIEW_H_INCLUDED
@@ -0,0 +1,85 @@
+#include <iostream>
+#include <map>
+#include <utility>
+
+#include "../common/benchmark.h"
+#include "concurrent_retroactive_unordered_set.h"
+#include "retroactive_unordered_set.h"
+
+using namespace std;
+
+/// Updates are insertions (add) or erasures of the value. Queries are finds at their time.
+struct unordered_set_subject {
+    retroactive_unordered_set<int> s;
+
+    static const char *name() {
+        return "retroactive";
+    }
+
+    long long apply(const workload_op& op) {
+        switch (op.kind) {
+        case workload_op::update:
+            return op.add ? s.insert(op.value, op.tm) : s.erase(op.value, op.tm);
+        case workload_op::remove:
+            return s.delete_operation(op.tm);
+        default:
+            return s.find(op.value, op.tm);
+        }
+    }
+};
+
+/// The same operations through the variant with lock-free readers, from a single thread: the
+/// cost of copying the histories and of the reader announcements.
+struct rcu_unordered_set_subject {
+    concurrent_retroactive_unordered_set<int> s;
+
+    static const char *name() {
+        return "rcu";
+    }
+
+    long long apply(const workload_op& op) {
+        switch (op.kind) {
+        case workload_op::update:
+            return op.add ? s.insert(op.value, op.tm) : s.erase(op.value, op.tm);
+        case workload_op::remove:
+            return s.delete_operation(op.tm);
+        default:
+            return s.find(op.value, op.tm);
+        }
+    }
+};
+
+/// Keeps the log of operations only and replays it for every query.
+struct unordered_set_baseline {
+    map<long long, pair<int, bool>> log; // time -> (element, is insert operation)
+
+    static const char *name() {
+        return "naive replay";
+    }
+
+    long long apply(const workload_op& op) {
+        switch (op.kind) {
+        case workload_op::update:
+            return log.emplace(op.tm, make_pair(op.value, op.add)).second;
+        case workload_op::remove:
+            return log.erase(op.tm) > 0;
+        default: {
+            bool present = false;
+            for (auto it = log.begin(); it != log.end() && it->first <= op.tm; ++it)
+                if (it->second.first == op.value)
+                    present = it->second.second;
+            return present;
+        }
+        }
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    benchmark_options options;
+    if (!parse_benchmark_options(argc, argv, options)) {
+        cerr << "usage: " << argv[0] << " [--ops N,...] [--mix NAME,...] [--seed S] [--keys K] [--baseline-limit N]" << endl;
+        return 2;
+    }
+    return benchmark_suite<unordered_set_baseline, unordered_set_subject, rcu_unordered_set_subject>::run(options);
+}
@@ -0,0 +1,531 @@
+#ifndef CONCURRENT_RETROACTIVE_UNORDERED_SET_H_INCLUDED
+#define CONCURRENT_RETROACTIVE_UNORDERED_SET_H_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../common/journal.h"
+#include "../common/operation_log.h"
+#include "../common/retroactive_stats.h"
+#include "../common/snapshot.h"
+#include "retroactive_unordered_set.h"
+
+/// retroactive_unordered_set whose readers never lock (build with -pthread). Every element
+/// has an immutable version of its history, published through an atomic pointer of its
+/// entry in a hash index; updates are serialized by a mutex, publish a new version and retire
+/// the old one. Retired versions (and index tables replaced by a rehash) are freed by
+/// epoch-based reclamation once no reader that might still see them is active, so a find is
+/// a few atomic loads and a binary search whatever the writers do.
+///
+/// Versions share the operations they have in common (see history), so an operation after
+/// all the others of its element, like the ones at the present, costs O(log n) amortized;
+/// other updates copy the history of the element, O(log n + h) for h operations on it.
+///
+/// Up to reader_slots threads read without waiting; the readers beyond that take the writer
+/// lock instead (see reader_guard).
+template<typename T, typename Hash = std::hash<T>>
+class concurrent_retroactive_unordered_set {
+
+private:
+    /// Operations on one element: times in increasing order and whether each of them is an
+    /// insertion. The versions sharing it each see a prefix of it, which never changes once
+    /// written, so a version whose prefix is all that was written is extended in place past
+    /// it, and the readers of the old version don't see the difference. It is copied into one
+    /// twice as large when full, and for the other edits.
+    struct history {
+        std::unique_ptr<long long[]> times;
+        std::unique_ptr<bool[]> inserted;
+        size_t capacity, used; // used is the number of operations written, see with_event()
+
+        explicit history(size_t capacity) : times(new long long[capacity]), inserted(new bool[capacity]),
+                capacity(capacity), used(0) { }
+    };
+
+    struct version {
+        std::shared_ptr<history> events;
+        size_t count; // the number of operations of events it sees
+
+        version(const std::shared_ptr<history>& events, size_t count) : events(events), count(count) { }
+
+        size_t index(long long tm) const { // the number of operations up to tm
+            const long long *times = events->times.get();
+            return std::upper_bound(times, times + count, tm) - times;
+        }
+
+        bool present(long long tm) const { // the last operation at or before tm is an insertion
+            size_t i = index(tm);
+            return i != 0 && events->inserted[i - 1];
+        }
+    };
+
+    /// Entries are never unlinked from their table, an element without operations just has
+    /// no version. Their next links are set before they are published.
+    struct entry {
+        T key;
+        std::atomic<const version*> current;
+        entry *next;
+
+        entry(const T& key, const version *current, entry *next) : key(key), current(current), next(next) { }
+    };
+
+    struct table {
+        size_t mask, size; // size is the number of entries
+        std::unique_ptr<std::atomic<entry*>[]> buckets;
+
+        explicit table(size_t bucket_count) : mask(bucket_count - 1), size(0),
+                buckets(new std::atomic<entry*>[bucket_count]) {
+            for (size_t i = 0; i <= mask; ++i)
+                buckets[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        ~table() {
+            for (size_t i = 0; i <= mask; ++i)
+                for (entry *e = buckets[i].load(std::memory_order_relaxed), *next; e; e = next) {
+                    next = e->next;
+                    delete e;
+                }
+        }
+    };
+
+    /// Something unlinked by the writer, freed once every reader active at that time is done.
+    struct retired {
+        unsigned long long epoch;
+        const version *old_version;
+        table *old_table;
+        bool with_versions; // the table owns the versions of its entries (clear())
+    };
+
+    /// Padded so that each slot has a cache line of its own; alignas wouldn't be honoured by
+    /// new[] before C++17.
+    struct reader_slot { // the epoch a reader entered at, or 0
+        std::atomic<unsigned long long> epoch;
+        char padding[64];
+    };
+
+    static const size_t reader_slots = 128;
+    static const size_t reclaim_batch = 64;
+
+    /// Announces a reader in a free slot for its lifetime. The announcement comes before the
+    /// reader loads any pointer (all of these are sequentially consistent), so the writer,
+    /// which scans the slots after unlinking, either sees the reader or the reader only
+    /// sees what was published after the unlinking. If every slot is taken, the reader holds
+    /// the writer lock instead, which keeps anything from being unlinked meanwhile.
+    class reader_guard {
+        reader_slot *slot;
+        std::unique_lock<std::mutex> writers;
+
+    public:
+        explicit reader_guard(const concurrent_retroactive_unordered_set<T, Hash>& s) : slot(nullptr), writers() {
+            size_t first = std::hash<std::thread::id>()(std::this_thread::get_id()) % reader_slots;
+            for (size_t k = 0; k < reader_slots; ++k) {
+                size_t i = (first + k) % reader_slots;
+                unsigned long long free_slot = 0;
+                if (s.readers[i].epoch.load() == 0 &&
+                    s.readers[i].epoch.compare_exchange_strong(free_slot, s.epoch.load())) {
+                    slot = &s.readers[i];
+                    return;
+                }
+            }
+            writers = std::unique_lock<std::mutex>(s.writer_lock);
+        }
+
+        ~reader_guard() {
+            if (slot)
+                slot->epoch.store(0);
+        }
+
+        reader_guard(const reader_guard&) = delete;
+        reader_guard& operator=(const reader_guard&) = delete;
+    };
+
+    std::atomic<table*> index;
+    std::unique_ptr<reader_slot[]> readers;
+    std::atomic<unsigned long long> epoch; // starts at 1, since 0 marks a free slot
+    Hash hash;
+
+    // State of the writers, guarded by writer_lock.
+    mutable std::mutex writer_lock;
+    operation_log<T> operations;
+    std::vector<retired> retired_list;
+    retroactive_journal<T> *journal; // nullptr if none is attached
+#ifdef RETROACTIVE_STATS
+    retroactive_counters counters;
+#endif
+
+    entry *find_entry(const table *t, const T& x) const {
+        for (entry *e = t->buckets[hash(x) & t->mask].load(); e; e = e->next)
+            if (e->key == x)
+                return e;
+        return nullptr;
+    }
+
+    void retire(const version *old_version, table *old_table, bool with_versions) {
+        if (!old_version && !old_table)
+            return;
+        retired_list.push_back({epoch.fetch_add(1), old_version, old_table, with_versions});
+        if (retired_list.size() >= reclaim_batch)
+            reclaim();
+    }
+
+    void free_retired(const retired& r) {
+        delete r.old_version;
+        if (r.old_table && r.with_versions)
+            for (size_t i = 0; i <= r.old_table->mask; ++i)
+                for (entry *e = r.old_table->buckets[i].load(); e; e = e->next)
+                    delete e->current.load();
+        delete r.old_table;
+    }
+
+    /// Frees everything retired before the oldest epoch a reader is still in.
+    void reclaim() {
+        unsigned long long oldest = std::numeric_limits<unsigned long long>::max();
+        for (size_t i = 0; i < reader_slots; ++i) {
+            unsigned long long e = readers[i].epoch.load();
+            if (e != 0)
+                oldest = std::min(oldest, e);
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < retired_list.size(); ++i) {
+            if (retired_list[i].epoch < oldest)
+                free_retired(retired_list[i]);
+            else
+                retired_list[kept++] = retired_list[i];
+        }
+        retired_list.resize(kept);
+    }
+
+    /// Publishes v as the history of x, which takes a new entry (and maybe a rehash) for an
+    /// element seen for the first time.
+    void publish(const T& x, const version *v) {
+        table *t = index.load();
+        entry *e = find_entry(t, x);
+        if (e) {
+            retire(e->current.exchange(v), nullptr, false);
+            return;
+        }
+
+        if (t->size >= 2 * (t->mask + 1)) { // rehash into a new table, the versions are shared
+            table *bigger = new table(4 * (t->mask + 1));
+            for (size_t i = 0; i <= t->mask; ++i)
+                for (entry *old = t->buckets[i].load(); old; old = old->next) {
+                    const version *kept = old->current.load();
+                    if (!kept)
+                        continue; // drops the elements without operations
+                    std::atomic<entry*>& bucket = bigger->buckets[hash(old->key) & bigger->mask];
+                    bucket.store(new entry(old->key, kept, bucket.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+                    ++bigger->size;
+                }
+            index.store(bigger);
+            retire(nullptr, t, false);
+            t = bigger;
+        }
+        std::atomic<entry*>& bucket = t->buckets[hash(x) & t->mask];
+        bucket.store(new entry(x, v, bucket.load()));
+        ++t->size;
+    }
+
+    inline void log_update(journal_op op, const T& x, long long tm) { // with writer_lock held
+        if (journal) {
+            journal_record<T> update = {op, x, tm};
+            journal->record(&update, 1);
+        }
+    }
+
+    /// The history of old (nullptr if none) with an operation at tm added: written in place
+    /// past the end of old if it is the last operation and nothing was written there yet.
+    static version *with_event(const version *old, long long tm, bool ins) {
+        size_t count = (old ? old->count : 0);
+        if (old && old->events->used == count && count < old->events->capacity &&
+            old->events->times[count - 1] < tm) {
+            old->events->times[count] = tm;
+            old->events->inserted[count] = ins;
+            ++old->events->used;
+            return new version(old->events, count + 1);
+        }
+
+        std::shared_ptr<history> events = std::make_shared<history>(std::max<size_t>(2 * count, 4));
+        size_t i = (old ? old->index(tm) : 0);
+        for (size_t j = 0; j < count; ++j) {
+            events->times[j + (j >= i)] = old->events->times[j];
+            events->inserted[j + (j >= i)] = old->events->inserted[j];
+        }
+        events->times[i] = tm;
+        events->inserted[i] = ins;
+        events->used = count + 1;
+        return new version(events, count + 1);
+    }
+
+    /// The history of old without its operation at tm, nullptr if that was the only one. The
+    /// last operation is just left out of the shared history.
+    static version *without_event(const version *old, long long tm) {
+        size_t count = old->count, i = old->index(tm) - 1;
+        if (count == 1)
+            return nullptr;
+        if (i == count - 1)
+            return new version(old->events, count - 1);
+
+        std::shared_ptr<history> events = std::make_shared<history>(count);
+        for (size_t j = 0; j < count; ++j)
+            if (j != i) {
+                events->times[j - (j > i)] = old->events->times[j];
+                events->inserted[j - (j > i)] = old->events->inserted[j];
+            }
+        events->used = count - 1;
+        return new version(events, count - 1);
+    }
+
+    bool add_event(const T& x, long long tm, bool ins) { // with writer_lock held
+        RETROACTIVE_COUNT(counters.updates);
+        if (!operations.insert(tm, x))
+            return false;
+
+        entry *e = find_entry(index.load(), x);
+        publish(x, with_event(e ? e->current.load() : nullptr, tm, ins));
+        log_update(ins ? journal_op::insert : journal_op::erase, x, tm);
+        return true;
+    }
+
+public:
+    typedef T value_type;
+
+    explicit concurrent_retroactive_unordered_set<T, Hash>(const Hash& hash = Hash()) : index(new table(16)),
+            readers(new reader_slot[reader_slots]), epoch(1), hash(hash), writer_lock(), operations(), retired_list(),
+            journal(nullptr) {
+        for (size_t i = 0; i < reader_slots; ++i)
+            readers[i].epoch.store(0);
+    }
+
+    concurrent_retroactive_unordered_set<T, Hash>(const concurrent_retroactive_unordered_set<T, Hash>&) = delete;
+    concurrent_retroactive_unordered_set<T, Hash>& operator=(const concurrent_retroactive_unordered_set<T, Hash>&) = delete;
+
+    /// There mustn't be any readers left.
+    ~concurrent_retroactive_unordered_set<T, Hash>() {
+        for (const retired& r : retired_list)
+            free_retired(r);
+        free_retired({0, nullptr, index.load(), true});
+    }
+
+
+    /*** Retroactive updates and queries ***/
+    /// Updates are serialized among themselves, but never wait for readers.
+    bool insert(const T& x, long long tm) {
+        std::lock_guard<std::mutex> guard(writer_lock);
+        return add_event(x, tm, true);
+    }
+
+    bool erase(const T& x, long long tm) {
+        std::lock_guard<std::mutex> guard(writer_lock);
+        return add_event(x, tm, false);
+    }
+
+    bool delete_operation(long long tm) {
+        std::lock_guard<std::mutex> guard(writer_lock);
+        RETROACTIVE_COUNT(counters.updates);
+        const T *found = operations.find(tm);
+        if (!found)
+            return false;
+
+        T x = *found;
+        operations.erase(tm);
+        publish(x, without_event(find_entry(index.load(), x)->current.load(), tm));
+        log_update(journal_op::remove, T(), tm);
+        return true;
+    }
+
+    /// Lock-free up to reader_slots concurrent readers: safe to call from any number of
+    /// threads, concurrently with the updates.
+    bool find(const T& x, long long tm = std::numeric_limits<long long>::max()) const {
+        reader_guard guard(*this);
+        const entry *e = find_entry(index.load(), x);
+        const version *v = (e ? e->current.load() : nullptr);
+        return v && v->present(tm);
+    }
+
+
+    /*** Present-time updates ***/
+    bool insert(const T& x) {
+        std::lock_guard<std::mutex> guard(writer_lock);
+        return add_event(x, operations.next_time(), true); // we assume that the operation is always successful
+    }
+
+    bool erase(const T& x) {
+        std::lock_guard<std::mutex> guard(writer_lock);
+        return add_event(x, operations.next_time(), false); // we assume that the operation is always successful
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(writer_lock);
+        operations.clear();
+        retire(nullptr, index.exchange(new table(16)), true);
+        log_update(journal_op::clear, T(), 0);
+    }
+
+
+    /*** Journal ***/
+    /// Hands every accepted update to journal from now on (see journal.h), nullptr detaches
+    /// it. The updates are recorded under the writer lock, so in the order they are applied;
+    /// with a write_ahead_log, each writer can commit() its update after it returns, and the
+    /// writers committing at the same time share a sync. checkpoint() may run while writers
+    /// keep going: the log is only reset if no update came in after the snapshot.
+    void attach_journal(retroactive_journal<T> *j) {
+        std::lock_guard<std::mutex> guard(writer_lock);
+        journal = j;
+    }
+
+    /// Applies the records of an update again, false if one of them is rejected.
+    bool replay(const std::vector<journal_record<T>>& update) {
+        for (const journal_record<T>& r : update) {
+            if (r.op == journal_op::clear)
+                clear();
+            else if (!(r.op == journal_op::insert ? insert(r.x, r.tm) :
+                       r.op == journal_op::erase ? erase(r.x, r.tm) :
+                       r.op == journal_op::remove && delete_operation(r.tm)))
+                return false;
+        }
+        return true;
+    }
+
+
+    /*** Snapshots ***/
+    /// Writes a snapshot of the set in the format of retroactive_unordered_set::save_snapshot,
+    /// so either container loads it and retroactive_unordered_set_view queries it. The contents
+    /// are copied under the writer lock, along with the position of the journal, and written
+    /// after it is released: readers never wait, and writers only for the copy.
+    bool save_snapshot(const std::string& path) const {
+        std::vector<T> keys, values;
+        std::vector<uint64_t> offsets(1, 0);
+        std::vector<long long> history_times, times;
+        std::vector<uint8_t> inserted;
+        uint64_t position;
+        {
+            std::lock_guard<std::mutex> guard(writer_lock);
+            std::vector<std::pair<T, const version*>> elements;
+            const table *t = index.load();
+            for (size_t i = 0; i <= t->mask; ++i)
+                for (const entry *e = t->buckets[i].load(); e; e = e->next)
+                    if (const version *v = e->current.load())
+                        elements.push_back({e->key, v});
+            std::sort(elements.begin(), elements.end(), [](const std::pair<T, const version*>& a,
+                                                           const std::pair<T, const version*>& b) {
+                return a.first < b.first;
+            });
+            std::vector<std::pair<long long, size_t>> order; // time -> index of its element in keys
+            for (const std::pair<T, const version*>& element : elements) {
+                const history& events = *element.second->events;
+                for (size_t i = 0; i < element.second->count; ++i) {
+                    history_times.push_back(events.times[i]);
+                    inserted.push_back(events.inserted[i]);
+                    order.push_back({events.times[i], keys.size()});
+                }
+                keys.push_back(element.first);
+                offsets.push_back(history_times.size());
+            }
+            std::sort(order.begin(), order.end());
+            for (const std::pair<long long, size_t>& op : order) {
+                times.push_back(op.first);
+                values.push_back(keys[op.second]);
+            }
+            position = (journal ? journal->position() : 0);
+        }
+
+        snapshot_writer writer(snapshot_kind::unordered_set, sizeof(T), position);
+        writer.add(times);
+        writer.add(values);
+        writer.add(keys);
+        writer.add(offsets);
+        writer.add(history_times);
+        writer.add(inserted);
+        return writer.write(path);
+    }
+
+    /// Replaces the contents of the set with a snapshot of a retroactive_unordered_set<T> or of
+    /// a concurrent_retroactive_unordered_set<T> in O(n log n), like clear(): the readers see
+    /// either the old contents or the new ones. Returns false and leaves the set as it was if
+    /// the file can't be read or isn't such a snapshot, checked like the sequential set does.
+    /// It isn't recorded in the journal.
+    bool load_snapshot(const std::string& path) {
+        typedef retroactive_unordered_set<T> sequential; // for the sections
+        snapshot_file file;
+        const long long *times, *history_times;
+        const T *values, *keys;
+        const uint64_t *offsets;
+        const uint8_t *inserted;
+        size_t n, value_count, key_count, offset_count, history_count, inserted_count;
+        if (!file.open(path, snapshot_kind::unordered_set, sizeof(T)) ||
+                !file.section(sequential::section_times, times, n) ||
+                !file.section(sequential::section_values, values, value_count) ||
+                !file.section(sequential::section_keys, keys, key_count) ||
+                !file.section(sequential::section_offsets, offsets, offset_count) ||
+                !file.section(sequential::section_history_times, history_times, history_count) ||
+                !file.section(sequential::section_inserted, inserted, inserted_count) ||
+                value_count != n || history_count != n || inserted_count != n || offset_count != key_count + 1 ||
+                !snapshot_offsets_valid(offsets, offset_count, history_count))
+            return false;
+
+        for (size_t i = 0; i < key_count; ++i) {
+            if (offsets[i] == offsets[i + 1] || (i > 0 && !(keys[i - 1] < keys[i])))
+                return false;
+            for (uint64_t j = offsets[i] + 1; j < offsets[i + 1]; ++j)
+                if (history_times[j] <= history_times[j - 1])
+                    return false; // the searches need increasing times
+        }
+        operation_log<T> loaded_operations;
+        for (size_t i = 0; i < n; ++i)
+            if (!loaded_operations.insert(times[i], values[i]))
+                return false;
+        if (!snapshot_log_matches(times, values, n, keys, key_count, offsets, history_times))
+            return false;
+
+        size_t bucket_count = 16;
+        while (2 * bucket_count <= key_count)
+            bucket_count *= 2;
+        table *loaded = new table(bucket_count);
+        for (size_t i = 0; i < key_count; ++i) {
+            size_t count = static_cast<size_t>(offsets[i + 1] - offsets[i]);
+            std::shared_ptr<history> events = std::make_shared<history>(count);
+            for (size_t j = 0; j < count; ++j) {
+                events->times[j] = history_times[offsets[i] + j];
+                events->inserted[j] = (inserted[offsets[i] + j] != 0);
+            }
+            events->used = count;
+            std::atomic<entry*>& bucket = loaded->buckets[hash(keys[i]) & loaded->mask];
+            bucket.store(new entry(keys[i], new version(events, count), bucket.load(std::memory_order_relaxed)),
+                         std::memory_order_relaxed);
+            ++loaded->size;
+        }
+
+        std::lock_guard<std::mutex> guard(writer_lock);
+        operations.swap(loaded_operations);
+        retire(nullptr, index.exchange(loaded), true);
+        return true;
+    }
+
+#ifdef RETROACTIVE_STATS
+    /// Bytes of the current versions of the histories; retired ones waiting for readers and
+    /// the index aren't counted.
+    retroactive_stats stats() {
+        std::lock_guard<std::mutex> guard(writer_lock);
+        retroactive_stats s;
+        s.counters = counters;
+        s.operations_bytes = operations.bytes();
+        const table *t = index.load();
+        for (size_t i = 0; i <= t->mask; ++i)
+            for (const entry *e = t->buckets[i].load(); e; e = e->next)
+                if (const version *v = e->current.load())
+                    s.sequences_bytes += sizeof(version) + sizeof(history) +
+                                         v->events->capacity * (sizeof(long long) + sizeof(bool));
+        return s;
+    }
+#endif
+};
+
+#endif // CONCURRENT_RETROACTIVE_UNORDERED_SET_H_INCLUDED
@@ -1,24 +1,105 @@
 #ifndef RETROACTIVE_UNORDERED_SET_H_INCLUDED
 #define RETROACTIVE_UNORDERED_SET_H_INCLUDED
 
-#include <functional>
+#include <algorithm>
+#include <cstdint>
 #include <limits>
 #include <map>
-#include <set>
+#include <string>
 #include <utility>
+#include <vector>
+
+#include "../common/journal.h"
+#include "../common/operation_log.h"
+#include "../common/retroactive_stats.h"
+#include "../common/snapshot.h"
 
 template<typename T>
 class retroactive_unordered_set {
 
 private:
-    std::map<long long, T> operations;
-    std::map<T, std::map<long long, bool, std::greater<long long>>> sequences; // (time/is insert operation)
+    /// Operations on one element: times in increasing order and whether each of them is an
+    /// insertion, packed into a bit. That is about 8 bytes per operation instead of a tree
+    /// node, and operations at the present are O(1) amortized appends.
+    struct history {
+        std::vector<long long> times;
+        std::vector<bool> inserted;
+
+        void add(long long tm, bool ins) {
+            if (times.empty() || times.back() < tm) {
+                times.push_back(tm);
+                inserted.push_back(ins);
+            } else {
+                auto it = std::lower_bound(times.begin(), times.end(), tm);
+                inserted.insert(inserted.begin() + (it - times.begin()), ins);
+                times.insert(it, tm);
+            }
+        }
+
+        void remove(long long tm) {
+            auto it = std::lower_bound(times.begin(), times.end(), tm);
+            inserted.erase(inserted.begin() + (it - times.begin()));
+            times.erase(it);
+        }
+
+        bool present(long long tm) const { // the last operation at or before tm is an insertion
+            auto it = std::upper_bound(times.begin(), times.end(), tm);
+            return it != times.begin() && inserted[it - times.begin() - 1];
+        }
+
+        /// present() at each of the given times. Each search gallops forward from where the
+        /// previous one ended, so sorted times cost O(log) of the gap between their answers.
+        void present_at(const std::vector<long long>& tms, std::vector<bool>& ans) const {
+            size_t pos = 0; // the first operation after the previous time
+            for (size_t i = 0; i < tms.size(); ++i) {
+                long long tm = tms[i];
+                if (i > 0 && tm < tms[i - 1])
+                    pos = 0;
+                size_t lo = pos, hi = pos, step = 1;
+                while (hi < times.size() && times[hi] <= tm) {
+                    lo = hi + 1;
+                    hi = lo + step;
+                    step *= 2;
+                }
+                hi = std::min(hi, times.size());
+                pos = std::upper_bound(times.begin() + lo, times.begin() + hi, tm) - times.begin();
+                ans[i] = (pos > 0 && inserted[pos - 1]);
+            }
+        }
+    };
+
+    operation_log<T> operations;
+    std::map<T, history> sequences;
+    retroactive_journal<T> *journal; // nullptr if none is attached
+#ifdef RETROACTIVE_STATS
+    retroactive_counters counters;
+#endif
 
     inline long long get_last_time() {
-        return operations.empty() ? 0 : operations.rbegin()->first + 1;
+        return operations.next_time();
+    }
+
+    inline void log_update(journal_op op, const T& x, long long tm) {
+        if (journal) {
+            journal_record<T> update = {op, x, tm};
+            journal->record(&update, 1);
+        }
+    }
+
+    /// clear() without recording it, for the moved-from containers.
+    void clear_contents() {
+        operations.clear();
+        sequences.clear();
     }
 
 public:
+    typedef T value_type;
+
+    /// Sections of the snapshots, see save_snapshot().
+    enum snapshot_section {
+        section_times, section_values, section_keys, section_offsets, section_history_times, section_inserted
+    };
+
     /*** Friend operators ***/
     template<class T1>
         friend bool operator==(const retroactive_unordered_set<T1>& x, const retroactive_unordered_set<T1> &y);
@@ -27,13 +108,18 @@ public:
 
 
     /*** Constructors and destructor ***/
-    retroactive_unordered_set<T>() : operations(), sequences() { }
+    retroactive_unordered_set<T>() : operations(), sequences(), journal(nullptr) { }
 
-    retroactive_unordered_set<T>(const retroactive_unordered_set<T>& other) {
+    retroactive_unordered_set<T>(const retroactive_unordered_set<T>& other) : journal(nullptr) {
         operations = other.operations;
         sequences = other.sequences;
     }
 
+    retroactive_unordered_set<T>(retroactive_unordered_set<T>&& other) noexcept :
+            operations(std::move(other.operations)), sequences(std::move(other.sequences)), journal(nullptr) {
+        other.clear_contents();
+    }
+
     ~retroactive_unordered_set<T>() { }
 
 
@@ -44,39 +130,59 @@ public:
         return *this;
     }
 
+    retroactive_unordered_set<T>& operator=(retroactive_unordered_set<T>&& other) noexcept {
+        if (this == &other)
+            return *this;
+        swap(other);
+        other.clear_contents();
+        return *this;
+    }
+
+    void swap(retroactive_unordered_set<T>& other) noexcept {
+        operations.swap(other.operations);
+        std::swap(sequences, other.sequences);
+#ifdef RETROACTIVE_STATS
+        std::swap(counters, other.counters);
+#endif
+    }
+
 
     /*** Retroactive updates and queries ***/
     bool insert(const T& x, long long tm) {
+        RETROACTIVE_COUNT(counters.updates);
         // If the element is already in the set, this operations has no effect.
-        if (operations.find(tm) != operations.end())
+        if (!operations.insert(tm, x))
             return false;
 
-        operations[tm] = x;
-        sequences[x][tm] = true;
+        sequences[x].add(tm, true);
+        log_update(journal_op::insert, x, tm);
         return true;
     }
 
     bool erase(const T& x, long long tm) {
+        RETROACTIVE_COUNT(counters.updates);
         // If the element has already been erased from the set, this operations has no effect.
-        if (operations.find(tm) != operations.end())
+        if (!operations.insert(tm, x))
             return false;
 
-        operations[tm] = x;
-        sequences[x][tm] = false;
+        sequences[x].add(tm, false);
+        log_update(journal_op::erase, x, tm);
         return true;
     }
 
     bool delete_operation(long long tm) {
-        auto it = operations.find(tm);
-        if (it == operations.end())
+        RETROACTIVE_COUNT(counters.updates);
+        const T *x = operations.find(tm);
+        if (!x)
             return false;
 
-        auto seq_it = sequences.find(it->second);
-        if (seq_it->second.size() == 1)
+        auto seq_it = sequences.find(*x);
+        if (seq_it->second.times.size() == 1)
             sequences.erase(seq_it);
         else
-            seq_it->second.erase(tm);
+            seq_it->second.remove(tm);
         operations.erase(tm);
+        log_update(journal_op::remove, T(), tm);
         return true;
     }
 
@@ -85,8 +191,17 @@ public:
         if (seq_it == sequences.end())
             return false;
 
-        auto it = seq_it->second.lower_bound(tm);
-        return it != seq_it->second.end() && it->second;
+        return seq_it->second.present(tm);
+    }
+
+    /// find at each of the given times, in one forward pass over the history of x when the
+    /// times are sorted.
+    std::vector<bool> find_at(const T& x, const std::vector<long long>& times) {
+        std::vector<bool> ans(times.size(), false);
+        auto seq_it = sequences.find(x);
+        if (seq_it != sequences.end())
+            seq_it->second.present_at(times, ans);
+        return ans;
     }
 
 
@@ -100,9 +215,126 @@ public:
     }
 
     void clear() {
-        operations.clear();
-        sequences.clear();
+        clear_contents();
+        log_update(journal_op::clear, T(), 0);
+    }
+
+
+    /*** Journal ***/
+    /// Hands every accepted update to journal from now on (see journal.h), nullptr detaches
+    /// it. The journal stays with this set: it isn't copied, moved or swapped, and
+    /// assignments, swaps and load_snapshot() aren't recorded.
+    void attach_journal(retroactive_journal<T> *j) {
+        journal = j;
+    }
+
+    /// Applies the records of an update again, false if one of them is rejected.
+    bool replay(const std::vector<journal_record<T>>& update) {
+        for (const journal_record<T>& r : update) {
+            if (r.op == journal_op::clear)
+                clear();
+            else if (!(r.op == journal_op::insert ? insert(r.x, r.tm) :
+                       r.op == journal_op::erase ? erase(r.x, r.tm) :
+                       r.op == journal_op::remove && delete_operation(r.tm)))
+                return false;
+        }
+        return true;
+    }
+
+
+    /*** Snapshots ***/
+    /// Writes a snapshot (see snapshot.h) of the set, whose elements have to be trivially
+    /// copyable: the operations in time order (times, values) and the histories of the
+    /// elements in increasing order of the elements (keys), the history of the i-th one
+    /// being [offsets[i], offsets[i + 1]) of history_times and inserted, along with the
+    /// position of the journal. retroactive_unordered_set_view queries such a file in place.
+    bool save_snapshot(const std::string& path) const {
+        std::vector<T> keys, values;
+        std::vector<uint64_t> offsets(1, 0);
+        std::vector<long long> history_times, times;
+        std::vector<uint8_t> inserted;
+        std::vector<std::pair<long long, size_t>> order; // time -> index of its element in keys
+        for (auto it = sequences.begin(); it != sequences.end(); ++it) {
+            for (size_t i = 0; i < it->second.times.size(); ++i) {
+                history_times.push_back(it->second.times[i]);
+                inserted.push_back(it->second.inserted[i]);
+                order.push_back({it->second.times[i], keys.size()});
+            }
+            keys.push_back(it->first);
+            offsets.push_back(history_times.size());
+        }
+        std::sort(order.begin(), order.end());
+        for (const std::pair<long long, size_t>& op : order) {
+            times.push_back(op.first);
+            values.push_back(keys[op.second]);
+        }
+
+        snapshot_writer writer(snapshot_kind::unordered_set, sizeof(T), journal ? journal->position() : 0);
+        writer.add(times);
+        writer.add(values);
+        writer.add(keys);
+        writer.add(offsets);
+        writer.add(history_times);
+        writer.add(inserted);
+        return writer.write(path);
     }
+
+    /// Replaces the contents of the set with a snapshot: the histories and the log are copied
+    /// as they are, then each operation of the log is looked up in the history of its element,
+    /// O(n log n). Returns false and leaves the set as it was if the file can't be read or isn't
+    /// a snapshot of a retroactive_unordered_set<T>: the histories have to be sorted and hold
+    /// the same operations as the log.
+    bool load_snapshot(const std::string& path) {
+        snapshot_file file;
+        const long long *times, *history_times;
+        const T *values, *keys;
+        const uint64_t *offsets;
+        const uint8_t *inserted;
+        size_t n, value_count, key_count, offset_count, history_count, inserted_count;
+        if (!file.open(path, snapshot_kind::unordered_set, sizeof(T)) ||
+                !file.section(section_times, times, n) || !file.section(section_values, values, value_count) ||
+                !file.section(section_keys, keys, key_count) || !file.section(section_offsets, offsets, offset_count) ||
+                !file.section(section_history_times, history_times, history_count) ||
+                !file.section(section_inserted, inserted, inserted_count) ||
+                value_count != n || history_count != n || inserted_count != n || offset_count != key_count + 1 ||
+                !snapshot_offsets_valid(offsets, offset_count, history_count))
+            return false;
+
+        retroactive_unordered_set<T> loaded;
+        for (size_t i = 0; i < key_count; ++i) {
+            if (offsets[i] == offsets[i + 1] || (i > 0 && !(keys[i - 1] < keys[i])))
+                return false;
+            for (uint64_t j = offsets[i] + 1; j < offsets[i + 1]; ++j)
+                if (history_times[j] <= history_times[j - 1])
+                    return false; // the searches need increasing times
+            history& seq = loaded.sequences.emplace_hint(loaded.sequences.end(), keys[i], history())->second;
+            seq.times.assign(history_times + offsets[i], history_times + offsets[i + 1]);
+            seq.inserted.assign(inserted + offsets[i], inserted + offsets[i + 1]);
+        }
+        for (size_t i = 0; i < n; ++i)
+            if (!loaded.operations.insert(times[i], values[i]))
+                return false;
+        if (!snapshot_log_matches(times, values, n, keys, key_count, offsets, history_times))
+            return false;
+#ifdef RETROACTIVE_STATS
+        loaded.counters = counters;
+#endif
+        swap(loaded);
+        return true;
+    }
+
+#ifdef RETROACTIVE_STATS
+    /// Bytes of the histories of the elements. There are no trees of its own.
+    retroactive_stats stats() const {
+        retroactive_stats s;
+        s.counters = counters;
+        s.operations_bytes = operations.bytes();
+        for (auto it = sequences.begin(); it != sequences.end(); ++it)
+            s.sequences_bytes += retroactive_stats::tree_node_bytes<std::pair<const T, history>>() +
+                                 it->second.times.capacity() * sizeof(long long) + it->second.inserted.capacity() / 8;
+        return s;
+    }
+#endif
 };
 
 
@@ -117,4 +349,9 @@ inline bool operator!=(const retroactive_unordered_set<T>& x, const retroactive_
     return !(x == y);
 }
 
+template<class T>
+inline void swap(retroactive_unordered_set<T>& x, retroactive_unordered_set<T>& y) noexcept {
+    x.swap(y);
+}
+
 #endif // RETROACTIVE_UNORDERED_SET_H_INCLUDED
@@ -0,0 +1,72 @@
+#ifndef RETROACTIVE_UNORDERED_SET_VIEW_H_INCLUDED
+#define RETROACTIVE_UNORDERED_SET_VIEW_H_INCLUDED
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+#include "../common/snapshot.h"
+#include "retroactive_unordered_set.h"
+
+/// Read-only retroactive_unordered_set answering queries straight from a snapshot mapped into
+/// memory (see retroactive_unordered_set::save_snapshot). Opening it is O(1) whatever the size
+/// of the snapshot and a find is two binary searches in the file, so only the pages the queries
+/// touch are ever read. A broken file can give wrong answers, but never reads outside of it.
+template<typename T>
+class retroactive_unordered_set_view {
+
+private:
+    typedef retroactive_unordered_set<T> container;
+
+    snapshot_file file;
+    const T *keys;
+    const uint64_t *offsets;
+    const long long *times;
+    const uint8_t *inserted;
+    size_t key_count, history_count;
+
+public:
+    retroactive_unordered_set_view<T>() : file(), keys(nullptr), offsets(nullptr), times(nullptr), inserted(nullptr),
+            key_count(0), history_count(0) { }
+
+    bool open(const std::string& path) {
+        close();
+        size_t offset_count, inserted_count;
+        if (!file.open(path, snapshot_kind::unordered_set, sizeof(T)) ||
+                !file.section(container::section_keys, keys, key_count) ||
+                !file.section(container::section_offsets, offsets, offset_count) ||
+                !file.section(container::section_history_times, times, history_count) ||
+                !file.section(container::section_inserted, inserted, inserted_count) ||
+                offset_count != key_count + 1 || inserted_count != history_count) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        file.close();
+        keys = nullptr;
+        key_count = history_count = 0;
+    }
+
+    inline bool is_open() const {
+        return file.is_open();
+    }
+
+    bool find(const T& x, long long tm = std::numeric_limits<long long>::max()) const {
+        const T *key = std::lower_bound(keys, keys + key_count, x);
+        if (key == keys + key_count || x < *key)
+            return false;
+
+        size_t i = key - keys;
+        uint64_t first = offsets[i], last = offsets[i + 1];
+        if (first > last || last > history_count)
+            return false;
+        const long long *it = std::upper_bound(times + first, times + last, tm);
+        return it != times + first && inserted[it - times - 1];
+    }
+};
+
+#endif // RETROACTIVE_UNORDERED_SET_VIEW_H_INCLUDED